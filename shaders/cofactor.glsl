@@ -0,0 +1,11 @@
+// Shared by every shader that moves normals, included from skinning.glsl and instance.glsl.
+#ifndef COFACTOR_GLSL
+#define COFACTOR_GLSL
+
+// Points the same way as the inverse transpose, normals get renormalized anyway.
+mat3 Cofactor(mat3 m)
+{
+    return mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+}
+
+#endif
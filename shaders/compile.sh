@@ -1,4 +1,8 @@
 #!/bin/sh
 
 glslc ./shader.frag -o ./shader.frag.spv &&
-glslc ./shader.vert -o ./shader.vert.spv
+glslc ./shader.vert -o ./shader.vert.spv &&
+glslc ./static.vert -o ./static.vert.spv &&
+glslc ./skinning.comp -o ./skinning.comp.spv &&
+glslc ./cull.comp -o ./cull.comp.spv &&
+glslc ./draw_commands.comp -o ./draw_commands.comp.spv
@@ -0,0 +1,87 @@
+// Shared by cull.comp and draw_commands.comp, the structs match renderer.h. Counts hold every group's
+// commands followed by every record's visible instances per mesh LOD, cleared before culling.
+
+#define MAX_MESH_LODS 4
+
+struct CullInstance
+{
+    vec4 sphere;
+    uint batch;
+    uint batchIndex;
+    float lodScale;
+    uint padding;
+};
+
+struct CullBatch
+{
+    uint instanceBase;
+    uint instanceCount;
+    uint firstRecord;
+    uint recordCount;
+};
+
+struct DrawRecord
+{
+    uint firstIndex[MAX_MESH_LODS];
+    uint indexCount[MAX_MESH_LODS];
+    float error[MAX_MESH_LODS];
+    uint lodCount;
+    uint group;
+    uint firstCommand;
+    uint instanceRun;
+    uint visibleBase;
+    uint instanceCount;
+    int vertexOffset;
+    uint padding;
+};
+
+// VkDrawIndexedIndirectCommand
+struct DrawCommand
+{
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+};
+
+layout (push_constant) uniform Constants
+{
+    vec4 frustumPlanes[6];
+    vec3 cameraPosition;
+    float pixelsPerUnit;
+    float maxPixelError;
+    uint instanceCount;
+    uint recordCount;
+    uint groupCount;
+};
+
+layout(std430, set = 0, binding = 3) writeonly buffer VisibleInstances
+{
+    uint visibleInstances[];
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer CullInstances
+{
+    CullInstance cullInstances[];
+};
+
+layout(std430, set = 1, binding = 1) readonly buffer CullBatches
+{
+    CullBatch batches[];
+};
+
+layout(std430, set = 1, binding = 2) readonly buffer DrawRecords
+{
+    DrawRecord records[];
+};
+
+layout(std430, set = 1, binding = 3) buffer DrawCounts
+{
+    uint counts[];
+};
+
+layout(std430, set = 1, binding = 4) writeonly buffer DrawCommands
+{
+    DrawCommand commands[];
+};
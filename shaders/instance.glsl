@@ -0,0 +1,28 @@
+// Shared by shader.vert and static.vert. Written per instance and mesh node every frame, draws
+// cover a run of visible instance indices with gl_InstanceIndex.
+
+#include "cofactor.glsl"
+
+struct InstanceData
+{
+    mat4 model;
+    vec4 positionQuantization;
+    uint paletteBase;
+    uint skinnedVertexBase;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer Instances
+{
+    InstanceData instances[];
+};
+
+// Written by CPU culling, or by cull.comp when the draws are GPU driven.
+layout(std430, set = 0, binding = 3) readonly buffer VisibleInstances
+{
+    uint visibleInstances[];
+};
+
+InstanceData GetInstance()
+{
+    return instances[visibleInstances[gl_InstanceIndex]];
+}
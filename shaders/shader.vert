@@ -1,38 +1,33 @@
 #version 460
+#extension GL_GOOGLE_include_directive : require
 
-layout (location = 0) in vec3 position;
-layout (location = 1) in vec3 normal;
+#include "instance.glsl"
+#include "skinning.glsl"
+
+layout (location = 0) in vec4 position;
+layout (location = 1) in vec2 normal;
 layout (location = 2) in vec2 texCoord;
-layout (location = 3) in ivec4 joints;
+layout (location = 3) in uvec4 joints;
 layout (location = 4) in vec4 weights;
 
 layout (location = 0) out vec3 outNormal;
 
-layout (push_constant) uniform Constants 
-{
-    mat4 model;
-};
-
 layout(std140, set = 0, binding = 0) uniform GlobalUniforms 
 {
     mat4 viewProjection;
 };
 
-layout(std140, set = 1, binding = 0) buffer JointUniforms
-{
-    mat4 jointMatrices[];
-};
-
 layout (location = 1) out vec4 outColor;
 
 void main() 
 {
-    mat4 skinMatrix = 
-        weights[0] * jointMatrices[joints[0]] +
-        weights[1] * jointMatrices[joints[1]] +
-        weights[2] * jointMatrices[joints[2]] +
-        weights[3] * jointMatrices[joints[3]];
-
-    outNormal = transpose(inverse(mat3(model * skinMatrix))) * normalize(normal);
-    gl_Position = viewProjection * model * skinMatrix * vec4(position, 1);
+    InstanceData instance = GetInstance();
+    mat4 model = instance.model;
+    vec3 skinnedPosition = DecodePosition(position.xyz, instance.positionQuantization);
+    vec3 skinnedNormal = DecodeOctahedral(normal);
+    SkinVertex(instance.paletteBase, ivec4(joints), weights, skinnedPosition, skinnedNormal);
+
+    // The fragment shader renormalizes.
+    outNormal = Cofactor(mat3(model)) * skinnedNormal;
+    gl_Position = viewProjection * model * vec4(skinnedPosition, 1);
 }
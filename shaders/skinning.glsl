@@ -0,0 +1,81 @@
+// Shared by shader.vert and skinning.comp. The palette format is picked per skin at load time and
+// baked into the pipeline through a specialization constant.
+
+#include "cofactor.glsl"
+
+#define PALETTE_FORMAT_MAT4 0
+#define PALETTE_FORMAT_MAT3X4 1
+#define PALETTE_FORMAT_DUAL_QUAT 2
+
+layout (constant_id = 0) const uint paletteFormat = PALETTE_FORMAT_MAT4;
+
+layout(std430, set = 1, binding = 0) readonly buffer Palette
+{
+    vec4 palette[];
+};
+
+// Vertices are packed, see PackedVertex in renderer.h.
+vec3 DecodePosition(vec3 position, vec4 quantization)
+{
+    return quantization.xyz + position * quantization.w;
+}
+
+vec3 DecodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0);
+    n.x += n.x >= 0 ? -t : t;
+    n.y += n.y >= 0 ? -t : t;
+    return normalize(n);
+}
+
+// paletteBase is where the skin starts in the frame's palette ring, or in the asset's baked VAT
+// palettes when those are bound instead, in vec4s.
+void SkinVertex(uint paletteBase, ivec4 joints, vec4 weights, inout vec3 position, inout vec3 normal)
+{
+    if (paletteFormat == PALETTE_FORMAT_DUAL_QUAT) {
+        vec4 real = vec4(0);
+        vec4 dual = vec4(0);
+        vec4 pivot = palette[paletteBase + joints[0] * 2];
+        for (int i = 0; i < 4; ++i) {
+            vec4 r = palette[paletteBase + joints[i] * 2];
+            vec4 d = palette[paletteBase + joints[i] * 2 + 1];
+            // Keep every joint on the same hemisphere as the first so the blend takes the short way around.
+            float weight = dot(r, pivot) < 0 ? -weights[i] : weights[i];
+            real += weight * r;
+            dual += weight * d;
+        }
+
+        float len = length(real);
+        real /= len;
+        dual /= len;
+
+        vec3 translation = 2 * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+        position += 2 * cross(real.xyz, cross(real.xyz, position) + real.w * position);
+        position += translation;
+        normal += 2 * cross(real.xyz, cross(real.xyz, normal) + real.w * normal);
+    } else if (paletteFormat == PALETTE_FORMAT_MAT3X4) {
+        vec4 row0 = vec4(0);
+        vec4 row1 = vec4(0);
+        vec4 row2 = vec4(0);
+        for (int i = 0; i < 4; ++i) {
+            uint base = paletteBase + joints[i] * 3;
+            row0 += weights[i] * palette[base + 0];
+            row1 += weights[i] * palette[base + 1];
+            row2 += weights[i] * palette[base + 2];
+        }
+
+        vec4 p = vec4(position, 1);
+        position = vec3(dot(row0, p), dot(row1, p), dot(row2, p));
+        normal = Cofactor(transpose(mat3(row0.xyz, row1.xyz, row2.xyz))) * normal;
+    } else {
+        mat4 skinMatrix = mat4(0);
+        for (int i = 0; i < 4; ++i) {
+            uint base = paletteBase + joints[i] * 4;
+            skinMatrix += weights[i] * mat4(palette[base + 0], palette[base + 1], palette[base + 2], palette[base + 3]);
+        }
+
+        position = (skinMatrix * vec4(position, 1)).xyz;
+        normal = Cofactor(mat3(skinMatrix)) * normal;
+    }
+}
@@ -0,0 +1,33 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "instance.glsl"
+
+layout (location = 0) out vec3 outNormal;
+
+struct SkinnedVertex
+{
+    vec4 position;
+    vec4 normal;
+};
+
+layout(std140, set = 0, binding = 0) uniform GlobalUniforms 
+{
+    mat4 viewProjection;
+};
+
+// Written by skinning.comp, the instance's base already points at the node's own range.
+layout(std430, set = 0, binding = 2) readonly buffer SkinnedVertices
+{
+    SkinnedVertex skinnedVertices[];
+};
+
+void main() 
+{
+    InstanceData instance = GetInstance();
+    SkinnedVertex vertex = skinnedVertices[instance.skinnedVertexBase + gl_VertexIndex];
+
+    // The fragment shader renormalizes.
+    outNormal = Cofactor(mat3(instance.model)) * vertex.normal.xyz;
+    gl_Position = viewProjection * instance.model * vec4(vertex.position.xyz, 1);
+}
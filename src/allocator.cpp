@@ -0,0 +1,219 @@
+#include "allocator.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+static inline VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void DeviceAllocator::Init(VkPhysicalDevice physicalDevice, VkDevice device)
+{
+    m_device = device;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+}
+
+uint32_t DeviceAllocator::ChooseMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags propertyFlags) const
+{
+    for (uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; ++i) {
+        const VkMemoryPropertyFlags flags = m_memoryProperties.memoryTypes[i].propertyFlags;
+        if ((memoryTypeBits & (1 << i)) && (flags & propertyFlags) == propertyFlags) {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Small heaps, like the 256 MiB BAR window, get smaller blocks so one of them can't take it all.
+VkDeviceSize DeviceAllocator::GetBlockSize(uint32_t memoryType) const
+{
+    const uint32_t heapIndex = m_memoryProperties.memoryTypes[memoryType].heapIndex;
+    const VkDeviceSize heapSize = m_memoryProperties.memoryHeaps[heapIndex].size;
+    return std::min<VkDeviceSize>(64ull << 20, heapSize / 8);
+}
+
+bool DeviceAllocator::AllocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, VkDeviceMemory &outMemory,
+                                           void *&outData)
+{
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = size;
+    allocateInfo.memoryTypeIndex = memoryType;
+    VkResult result = vkAllocateMemory(m_device, &allocateInfo, nullptr, &outMemory);
+    if (result != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: vkAllocateMemory of %llu bytes failed (%d)\n", (unsigned long long)size, result);
+        return false;
+    }
+
+    outData = nullptr;
+    if (m_memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        result = vkMapMemory(m_device, outMemory, 0, VK_WHOLE_SIZE, 0, &outData);
+        if (result != VK_SUCCESS) {
+            vkFreeMemory(m_device, outMemory, nullptr);
+            return false;
+        }
+    }
+    m_stats.deviceMemoryCount++;
+    return true;
+}
+
+// Best fit, the range that leaves the least behind once aligned. Alignment padding stays free.
+bool DeviceAllocator::AllocateFromBlock(MemoryBlock &block, VkDeviceSize size, VkDeviceSize alignment,
+                                        VkDeviceSize &outOffset)
+{
+    uint32_t best = UINT32_MAX;
+    VkDeviceSize bestWaste = ~0ull;
+    for (uint32_t i = 0; i < block.freeRanges.size(); ++i) {
+        const auto &range = block.freeRanges[i];
+        const VkDeviceSize padding = AlignUp(range.offset, alignment) - range.offset;
+        if (padding + size <= range.size && range.size - size - padding < bestWaste) {
+            best = i;
+            bestWaste = range.size - size - padding;
+        }
+    }
+    if (best == UINT32_MAX) {
+        return false;
+    }
+
+    const FreeRange range = block.freeRanges[best];
+    outOffset = AlignUp(range.offset, alignment);
+    block.freeRanges.erase(block.freeRanges.begin() + best);
+    if (bestWaste > 0) {
+        block.freeRanges.insert(block.freeRanges.begin() + best, {outOffset + size, bestWaste});
+    }
+    if (outOffset > range.offset) {
+        block.freeRanges.insert(block.freeRanges.begin() + best, {range.offset, outOffset - range.offset});
+    }
+    block.allocationCount++;
+    return true;
+}
+
+bool DeviceAllocator::Allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags propertyFlags,
+                               bool linear, DeviceAllocation &outAllocation)
+{
+    outAllocation = {};
+    const uint32_t memoryType = ChooseMemoryType(requirements.memoryTypeBits, propertyFlags);
+    if (memoryType == UINT32_MAX) {
+        return false;
+    }
+
+    const VkDeviceSize blockSize = GetBlockSize(memoryType);
+    if (requirements.size >= blockSize / 2) {
+        if (!AllocateDeviceMemory(memoryType, requirements.size, outAllocation.memory, outAllocation.data)) {
+            return false;
+        }
+        outAllocation.size = requirements.size;
+        m_stats.allocationCount++;
+        m_stats.usedBytes += requirements.size;
+        m_stats.dedicatedBytes += requirements.size;
+        return true;
+    }
+
+    uint32_t blockIndex = UINT32_MAX;
+    VkDeviceSize offset = 0;
+    for (uint32_t i = 0; i < m_blocks.size() && blockIndex == UINT32_MAX; ++i) {
+        auto &block = m_blocks[i];
+        if (block.memory && block.memoryType == memoryType && block.linear == linear &&
+            AllocateFromBlock(block, requirements.size, requirements.alignment, offset)) {
+            blockIndex = i;
+        }
+    }
+
+    if (blockIndex == UINT32_MAX) {
+        // Slots of freed blocks are reused so the indices held by live allocations stay valid.
+        blockIndex = 0;
+        while (blockIndex < m_blocks.size() && m_blocks[blockIndex].memory) {
+            blockIndex++;
+        }
+        if (blockIndex == m_blocks.size()) {
+            m_blocks.emplace_back();
+        }
+
+        auto &block = m_blocks[blockIndex];
+        if (!AllocateDeviceMemory(memoryType, blockSize, block.memory, block.data)) {
+            block = {};
+            return false;
+        }
+        block.size = blockSize;
+        block.memoryType = memoryType;
+        block.linear = linear;
+        block.allocationCount = 0;
+        block.freeRanges.assign(1, {0, blockSize});
+        AllocateFromBlock(block, requirements.size, requirements.alignment, offset);
+    }
+
+    const auto &block = m_blocks[blockIndex];
+    outAllocation.memory = block.memory;
+    outAllocation.offset = offset;
+    outAllocation.size = requirements.size;
+    outAllocation.data = block.data ? (uint8_t *)block.data + offset : nullptr;
+    outAllocation.block = blockIndex;
+    m_stats.allocationCount++;
+    m_stats.usedBytes += requirements.size;
+    UpdateFreeStats();
+    return true;
+}
+
+void DeviceAllocator::Free(DeviceAllocation &allocation)
+{
+    if (!allocation.memory) {
+        return;
+    }
+
+    m_stats.allocationCount--;
+    m_stats.usedBytes -= allocation.size;
+    if (allocation.block == UINT32_MAX) {
+        vkFreeMemory(m_device, allocation.memory, nullptr);
+        m_stats.deviceMemoryCount--;
+        m_stats.dedicatedBytes -= allocation.size;
+        allocation = {};
+        return;
+    }
+
+    auto &block = m_blocks[allocation.block];
+    auto &ranges = block.freeRanges;
+    auto next = std::lower_bound(ranges.begin(), ranges.end(), allocation.offset,
+                                 [](const FreeRange &range, VkDeviceSize offset) { return range.offset < offset; });
+    next = ranges.insert(next, {allocation.offset, allocation.size});
+    if (next + 1 != ranges.end() && next->offset + next->size == (next + 1)->offset) {
+        next->size += (next + 1)->size;
+        ranges.erase(next + 1);
+    }
+    if (next != ranges.begin() && (next - 1)->offset + (next - 1)->size == next->offset) {
+        (next - 1)->size += next->size;
+        ranges.erase(next);
+    }
+
+    // Empty blocks go back to the driver right away, loads are rare enough.
+    if (--block.allocationCount == 0) {
+        vkFreeMemory(m_device, block.memory, nullptr);
+        m_stats.deviceMemoryCount--;
+        block = {};
+    }
+    allocation = {};
+    UpdateFreeStats();
+}
+
+void DeviceAllocator::UpdateFreeStats()
+{
+    m_stats.blockCount = 0;
+    m_stats.blockBytes = 0;
+    m_stats.freeRangeCount = 0;
+    m_stats.largestFreeRange = 0;
+    VkDeviceSize freeBytes = 0;
+    for (const auto &block : m_blocks) {
+        if (!block.memory) {
+            continue;
+        }
+
+        m_stats.blockCount++;
+        m_stats.blockBytes += block.size;
+        m_stats.freeRangeCount += (uint32_t)block.freeRanges.size();
+        for (const auto &range : block.freeRanges) {
+            m_stats.largestFreeRange = std::max(m_stats.largestFreeRange, range.size);
+            freeBytes += range.size;
+        }
+    }
+    m_stats.fragmentation = freeBytes > 0 ? 1.0f - (float)m_stats.largestFreeRange / (float)freeBytes : 0.0f;
+}
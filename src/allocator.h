@@ -0,0 +1,80 @@
+#pragma once
+
+#include <volk.h>
+
+#include <stdint.h>
+#include <vector>
+
+// A range of device memory. Host visible memory stays mapped for as long as the allocation lives.
+struct DeviceAllocation
+{
+    VkDeviceMemory memory = nullptr;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void *data = nullptr;
+    // Index into the allocator's blocks, UINT32_MAX for dedicated allocations.
+    uint32_t block = UINT32_MAX;
+};
+
+struct DeviceAllocatorStats
+{
+    uint32_t allocationCount = 0;
+    // vkAllocateMemory calls currently alive, blocks and dedicated allocations.
+    uint32_t deviceMemoryCount = 0;
+    uint32_t blockCount = 0;
+    VkDeviceSize blockBytes = 0;
+    VkDeviceSize usedBytes = 0;
+    VkDeviceSize dedicatedBytes = 0;
+    uint32_t freeRangeCount = 0;
+    VkDeviceSize largestFreeRange = 0;
+    // One minus the largest free range over all free bytes in blocks, zero when nothing is split up.
+    float fragmentation = 0.0f;
+};
+
+// Free range of a block, kept sorted by offset and merged with its neighbours on free.
+struct FreeRange
+{
+    VkDeviceSize offset;
+    VkDeviceSize size;
+};
+
+struct MemoryBlock
+{
+    VkDeviceMemory memory = nullptr;
+    VkDeviceSize size = 0;
+    void *data = nullptr;
+    uint32_t memoryType = UINT32_MAX;
+    // Buffers and optimal images never share a block, so bufferImageGranularity never comes up.
+    bool linear = true;
+    uint32_t allocationCount = 0;
+    std::vector<FreeRange> freeRanges;
+};
+
+// Sub-allocates buffers and images from large blocks per memory type with a best fit free list.
+// Resources of at least half a block get their own vkAllocateMemory. Not thread safe.
+class DeviceAllocator
+{
+  public:
+    void Init(VkPhysicalDevice physicalDevice, VkDevice device);
+    // Images with optimal tiling are the only non linear resources.
+    bool Allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags propertyFlags, bool linear,
+                  DeviceAllocation &outAllocation);
+    void Free(DeviceAllocation &allocation);
+
+    inline const DeviceAllocatorStats &GetStats() const
+    {
+        return m_stats;
+    }
+
+  private:
+    uint32_t ChooseMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags propertyFlags) const;
+    VkDeviceSize GetBlockSize(uint32_t memoryType) const;
+    bool AllocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, VkDeviceMemory &outMemory, void *&outData);
+    bool AllocateFromBlock(MemoryBlock &block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &outOffset);
+    void UpdateFreeStats();
+
+    VkDevice m_device = nullptr;
+    VkPhysicalDeviceMemoryProperties m_memoryProperties = {};
+    std::vector<MemoryBlock> m_blocks;
+    DeviceAllocatorStats m_stats;
+};
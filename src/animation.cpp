@@ -0,0 +1,1074 @@
+#include "renderer.h"
+
+#include <chrono>
+#include <random>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+static inline glm::quat NormalizedLerp(glm::quat q0, glm::quat q1, float t)
+{
+    // Baked neighbours are kept in the same hemisphere so there is no sign fix up here.
+    return glm::normalize(q0 * (1.0f - t) + q1 * t);
+}
+
+static inline float RotationError(glm::quat a, glm::quat b)
+{
+    float d = glm::min(glm::abs(glm::dot(a, b)), 1.0f);
+    return 2.0f * acosf(d);
+}
+
+uint32_t NodeHierarchy::AddNode(uint32_t parent)
+{
+    assert(parent == UINT32_MAX || parent < GetCount());
+    parents.push_back(parent);
+    translations.push_back(glm::vec3(0));
+    scales.push_back(glm::vec3(1));
+    rotations.push_back(glm::quat());
+    matrices.push_back(glm::mat4(1));
+    localMatrices.push_back(glm::mat4(1));
+    worldMatrices.push_back(glm::mat4(1));
+    dirty.push_back(NodeDirty_Local);
+    meshIndices.push_back(UINT32_MAX);
+    skinIndices.push_back(UINT32_MAX);
+    return GetCount() - 1;
+}
+
+uint32_t NodeHierarchy::UpdateWorldMatrices()
+{
+    const uint32_t count = GetCount();
+    uint32_t updated = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t parent = parents[i];
+        uint8_t flags = dirty[i];
+        if (parent != UINT32_MAX && (dirty[parent] & NodeDirty_World)) {
+            flags |= NodeDirty_World;
+        }
+        if (flags & NodeDirty_Local) {
+            localMatrices[i] = GetLocalMatrix(i);
+            flags |= NodeDirty_World;
+        }
+        if (flags & NodeDirty_World) {
+            worldMatrices[i] = parent == UINT32_MAX ? localMatrices[i] : worldMatrices[parent] * localMatrices[i];
+            updated++;
+        }
+        dirty[i] = flags;
+    }
+
+    // Children read their parent's flags during the pass, so they are only cleared after it.
+    std::fill(dirty.begin(), dirty.end(), 0);
+    return updated;
+}
+
+size_t Animation::GetMemorySize() const
+{
+    size_t size = 0;
+    for (const auto &sampler : samplers) {
+        size += sampler.translation.values.size() * sizeof(glm::vec3) +
+                sampler.translation.times.size() * sizeof(float);
+        size += sampler.scale.values.size() * sizeof(glm::vec3) + sampler.scale.times.size() * sizeof(float);
+        size += sampler.rotation.values.size() * sizeof(glm::quat) + sampler.rotation.times.size() * sizeof(float);
+    }
+    return size;
+}
+
+size_t BakedAnimation::GetMemorySize() const
+{
+    return vec3Channels.size() * sizeof(BakedChannel) + quatChannels.size() * sizeof(BakedChannel) +
+           vec3Values.size() * sizeof(glm::vec3) + quatValues.size() * sizeof(glm::quat);
+}
+
+static void GetUniformFrames(float time, float sampleRate, uint32_t frameCount, uint32_t &outFrame0,
+                             uint32_t &outFrame1, float &outT)
+{
+    assert(frameCount > 0);
+
+    float frame = glm::max(time * sampleRate, 0.0f);
+    outFrame0 = glm::min((uint32_t)frame, frameCount - 1);
+    outFrame1 = glm::min(outFrame0 + 1, frameCount - 1);
+    outT = glm::min(frame - (float)outFrame0, 1.0f);
+}
+
+void BakedAnimation::GetFrames(float time, uint32_t &outFrame0, uint32_t &outFrame1, float &outT) const
+{
+    GetUniformFrames(time, sampleRate, frameCount, outFrame0, outFrame1, outT);
+}
+
+void BakedAnimation::Sample(float time, NodeHierarchy &nodes) const
+{
+    uint32_t f0, f1;
+    float t;
+    GetFrames(time, f0, f1, t);
+
+    const uint32_t vec3Count = (uint32_t)vec3Channels.size();
+    const glm::vec3 *vec3Frame0 = vec3Values.data() + f0 * vec3Count;
+    const glm::vec3 *vec3Frame1 = vec3Values.data() + f1 * vec3Count;
+    for (uint32_t i = 0; i < vec3Count; ++i) {
+        const auto &channel = vec3Channels[i];
+        glm::vec3 value = glm::mix(vec3Frame0[i], vec3Frame1[i], t);
+        if (channel.path == AnimationPath_Translation) {
+            nodes.translations[channel.node] = value;
+        } else {
+            nodes.scales[channel.node] = value;
+        }
+    }
+
+    const uint32_t quatCount = (uint32_t)quatChannels.size();
+    const glm::quat *quatFrame0 = quatValues.data() + f0 * quatCount;
+    const glm::quat *quatFrame1 = quatValues.data() + f1 * quatCount;
+    for (uint32_t i = 0; i < quatCount; ++i) {
+        nodes.rotations[quatChannels[i].node] = NormalizedLerp(quatFrame0[i], quatFrame1[i], t);
+    }
+}
+
+// Raw value of a spline the same way the runtime sees it: past the last key the node
+// keeps the last written value, which is the last key.
+template <typename T> static T EvaluateSpline(const AnimationSpline<T> &spline, float time, uint32_t &cursor)
+{
+    T value = spline.values.back();
+    spline.GetValueAtTime(time, value, cursor);
+    return value;
+}
+
+static void BakeAtRate(const Animation &animation, float sampleRate, BakedAnimation &outBaked)
+{
+    outBaked.sampleRate = sampleRate;
+    outBaked.frameCount = (uint32_t)ceilf(animation.endTime * sampleRate) + 1;
+    outBaked.vec3Channels.clear();
+    outBaked.quatChannels.clear();
+
+    std::vector<const AnimationSpline<glm::vec3> *> vec3Splines;
+    std::vector<const AnimationSpline<glm::quat> *> quatSplines;
+    for (const auto &sampler : animation.samplers) {
+        if (!sampler.translation.values.empty()) {
+            outBaked.vec3Channels.push_back({sampler.node, AnimationPath_Translation});
+            vec3Splines.push_back(&sampler.translation);
+        }
+        if (!sampler.scale.values.empty()) {
+            outBaked.vec3Channels.push_back({sampler.node, AnimationPath_Scale});
+            vec3Splines.push_back(&sampler.scale);
+        }
+        if (!sampler.rotation.values.empty()) {
+            outBaked.quatChannels.push_back({sampler.node, AnimationPath_Rotation});
+            quatSplines.push_back(&sampler.rotation);
+        }
+    }
+
+    const uint32_t vec3Count = (uint32_t)vec3Splines.size();
+    const uint32_t quatCount = (uint32_t)quatSplines.size();
+    outBaked.vec3Values.resize(outBaked.frameCount * vec3Count);
+    outBaked.quatValues.resize(outBaked.frameCount * quatCount);
+
+    std::vector<uint32_t> vec3Cursors(vec3Count, 1);
+    std::vector<uint32_t> quatCursors(quatCount, 1);
+    for (uint32_t f = 0; f < outBaked.frameCount; ++f) {
+        float time = glm::min((float)f / sampleRate, animation.endTime);
+
+        for (uint32_t i = 0; i < vec3Count; ++i) {
+            outBaked.vec3Values[f * vec3Count + i] = EvaluateSpline(*vec3Splines[i], time, vec3Cursors[i]);
+        }
+        for (uint32_t i = 0; i < quatCount; ++i) {
+            glm::quat value = EvaluateSpline(*quatSplines[i], time, quatCursors[i]);
+            if (f > 0 && glm::dot(value, outBaked.quatValues[(f - 1) * quatCount + i]) < 0.0f) {
+                value = -value;
+            }
+            outBaked.quatValues[f * quatCount + i] = value;
+        }
+    }
+}
+
+// Largest difference between the baked tracks and the source keys, checked at every key
+// and halfway between keys where linear and resampled curves drift apart the most.
+static void MeasureBakeError(const Animation &animation, const BakedAnimation &baked, float &outError,
+                             float &outRotationError)
+{
+    outError = 0.0f;
+    outRotationError = 0.0f;
+
+    auto sampleBaked = [&](uint32_t channel, float time, bool rotation, glm::vec3 &outVec3, glm::quat &outQuat) {
+        uint32_t f0, f1;
+        float t;
+        baked.GetFrames(time, f0, f1, t);
+        if (rotation) {
+            const uint32_t count = (uint32_t)baked.quatChannels.size();
+            outQuat = NormalizedLerp(baked.quatValues[f0 * count + channel], baked.quatValues[f1 * count + channel], t);
+        } else {
+            const uint32_t count = (uint32_t)baked.vec3Channels.size();
+            outVec3 = glm::mix(baked.vec3Values[f0 * count + channel], baked.vec3Values[f1 * count + channel], t);
+        }
+    };
+
+    uint32_t vec3Channel = 0;
+    uint32_t quatChannel = 0;
+    for (const auto &sampler : animation.samplers) {
+        const AnimationSpline<glm::vec3> *vec3Splines[] = {&sampler.translation, &sampler.scale};
+        for (const auto *spline : vec3Splines) {
+            if (spline->values.empty()) {
+                continue;
+            }
+            uint32_t cursor = 1;
+            for (uint32_t k = 0; k < spline->times.size(); ++k) {
+                float next = k + 1 < spline->times.size() ? spline->times[k + 1] : spline->times[k];
+                const float times[] = {spline->times[k], 0.5f * (spline->times[k] + next)};
+                for (float time : times) {
+                    glm::vec3 expected = EvaluateSpline(*spline, time, cursor);
+                    glm::vec3 value;
+                    glm::quat unused;
+                    sampleBaked(vec3Channel, time, false, value, unused);
+                    outError = glm::max(outError, glm::length(value - expected));
+                }
+            }
+            vec3Channel++;
+        }
+
+        if (!sampler.rotation.values.empty()) {
+            const auto &spline = sampler.rotation;
+            uint32_t cursor = 1;
+            for (uint32_t k = 0; k < spline.times.size(); ++k) {
+                float next = k + 1 < spline.times.size() ? spline.times[k + 1] : spline.times[k];
+                const float times[] = {spline.times[k], 0.5f * (spline.times[k] + next)};
+                for (float time : times) {
+                    glm::quat expected = EvaluateSpline(spline, time, cursor);
+                    glm::vec3 unused;
+                    glm::quat value;
+                    sampleBaked(quatChannel, time, true, unused, value);
+                    outRotationError = glm::max(outRotationError, RotationError(value, expected));
+                }
+            }
+            quatChannel++;
+        }
+    }
+}
+
+bool BakeAnimation(const Animation &animation, const AnimationBakeSettings &settings, BakedAnimation &outBaked)
+{
+    if (settings.sampleRate <= 0.0f) {
+        return false;
+    }
+
+    float sampleRate = settings.sampleRate;
+    for (;;) {
+        BakeAtRate(animation, sampleRate, outBaked);
+
+        float error, rotationError;
+        MeasureBakeError(animation, outBaked, error, rotationError);
+        if (error <= settings.maxError && rotationError <= settings.maxRotationError) {
+            return true;
+        }
+        if (sampleRate * 2.0f > settings.maxSampleRate) {
+            // Out of tolerance, the clip keeps sampling its keyframes.
+            LOG_ERROR("Baked animation exceeds error threshold at %.0f Hz (%f, %f rad)", sampleRate, error,
+                      rotationError);
+            outBaked = {};
+            return false;
+        }
+        sampleRate *= 2.0f;
+    }
+}
+
+//
+// Compression
+//
+
+static const float kSmallestThreeRange = 0.70710678f; // Largest possible value of the three smallest components.
+
+static void PackQuat(glm::quat q, uint16_t *outValues)
+{
+    uint32_t largest = 0;
+    for (uint32_t i = 1; i < 4; ++i) {
+        if (fabsf(q[i]) > fabsf(q[largest])) {
+            largest = i;
+        }
+    }
+    // q and -q are the same rotation, keeping the dropped component positive lets the
+    // decoder rebuild it from the other three.
+    if (q[largest] < 0.0f) {
+        q = -q;
+    }
+
+    uint16_t packed[3];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (i != largest) {
+            float v = glm::clamp(q[i] / kSmallestThreeRange * 0.5f + 0.5f, 0.0f, 1.0f);
+            packed[count++] = (uint16_t)(v * 32767.0f + 0.5f);
+        }
+    }
+
+    // 15 bits per component, the top bits of the first two hold the dropped index.
+    outValues[0] = packed[0] | (uint16_t)((largest >> 1) << 15);
+    outValues[1] = packed[1] | (uint16_t)((largest & 1) << 15);
+    outValues[2] = packed[2];
+}
+
+static glm::quat UnpackQuat(const uint16_t *values)
+{
+    uint32_t largest = ((values[0] >> 15) << 1) | (values[1] >> 15);
+    float smallest[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        smallest[i] = ((values[i] & 0x7fff) / 32767.0f * 2.0f - 1.0f) * kSmallestThreeRange;
+    }
+
+    float components[4];
+    float sum = 0.0f;
+    for (uint32_t i = 0, j = 0; i < 4; ++i) {
+        if (i != largest) {
+            components[i] = smallest[j++];
+            sum += components[i] * components[i];
+        }
+    }
+    components[largest] = sqrtf(glm::max(1.0f - sum, 0.0f));
+
+    return glm::quat(components[3], components[0], components[1], components[2]);
+}
+
+static void PackVec3(glm::vec3 v, const CompressedTrack &track, uint16_t *outValues)
+{
+    for (uint32_t i = 0; i < 3; ++i) {
+        float n = track.rangeExtent[i] > 0.0f ? (v[i] - track.rangeMin[i]) / track.rangeExtent[i] : 0.0f;
+        outValues[i] = (uint16_t)(glm::clamp(n, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    }
+}
+
+static glm::vec3 UnpackVec3(const uint16_t *values, const CompressedTrack &track)
+{
+    return track.rangeMin + glm::vec3(values[0], values[1], values[2]) * (track.rangeExtent / 65535.0f);
+}
+
+static inline glm::quat InterpolateQuat(glm::quat q0, glm::quat q1, float t)
+{
+    // Smallest-three keys are not kept in one hemisphere.
+    if (glm::dot(q0, q1) < 0.0f) {
+        q1 = -q1;
+    }
+    return NormalizedLerp(q0, q1, t);
+}
+
+static inline glm::vec3 InterpolateVec3(glm::vec3 v0, glm::vec3 v1, float t)
+{
+    return glm::mix(v0, v1, t);
+}
+
+// Finds the pair of keys around u, clamping to the ends of the track.
+static void FindCompressedKeys(const uint16_t *keyTimes, uint32_t count, float u, uint32_t &cursor,
+                               uint32_t &outKey0, uint32_t &outKey1, float &outT)
+{
+    if (count == 1 || u <= keyTimes[0]) {
+        outKey0 = outKey1 = 0;
+        outT = 0.0f;
+        return;
+    }
+    if (u >= keyTimes[count - 1]) {
+        outKey0 = outKey1 = count - 1;
+        outT = 0.0f;
+        return;
+    }
+
+    uint32_t k = cursor;
+    if (k < 1 || k >= count || keyTimes[k - 1] > u || u >= keyTimes[k]) {
+        if (k >= 1 && k + 1 < count && keyTimes[k] <= u && u < keyTimes[k + 1]) {
+            k = k + 1;
+        } else {
+            k = (uint32_t)(std::upper_bound(keyTimes + 1, keyTimes + count, u) - keyTimes);
+        }
+    }
+
+    cursor = k;
+    outKey0 = k - 1;
+    outKey1 = k;
+    outT = (u - keyTimes[k - 1]) / (float)(keyTimes[k] - keyTimes[k - 1]);
+}
+
+static inline float GetCompressedTime(const CompressedAnimation &animation, float time)
+{
+    return animation.duration > 0.0f ? glm::clamp(time / animation.duration, 0.0f, 1.0f) * 65535.0f : 0.0f;
+}
+
+static glm::vec3 SampleVec3Track(const CompressedAnimation &animation, const CompressedTrack &track, float u,
+                                 uint32_t &cursor)
+{
+    uint32_t k0, k1;
+    float t;
+    FindCompressedKeys(&animation.times[track.keyOffset], track.keyCount, u, cursor, k0, k1, t);
+    const uint16_t *keys = &animation.values[track.keyOffset * 3];
+    return InterpolateVec3(UnpackVec3(&keys[k0 * 3], track), UnpackVec3(&keys[k1 * 3], track), t);
+}
+
+static glm::quat SampleQuatTrack(const CompressedAnimation &animation, const CompressedTrack &track, float u,
+                                 uint32_t &cursor)
+{
+    uint32_t k0, k1;
+    float t;
+    FindCompressedKeys(&animation.times[track.keyOffset], track.keyCount, u, cursor, k0, k1, t);
+    const uint16_t *keys = &animation.values[track.keyOffset * 3];
+    return InterpolateQuat(UnpackQuat(&keys[k0 * 3]), UnpackQuat(&keys[k1 * 3]), t);
+}
+
+void CompressedAnimation::Sample(float time, AnimationCursor *cursors, NodeHierarchy &nodes) const
+{
+    const float u = GetCompressedTime(*this, time);
+
+    for (uint32_t i = 0; i < samplers.size(); ++i) {
+        const auto &sampler = samplers[i];
+        auto &cursor = cursors[i];
+
+        if (sampler.translation.keyCount > 0) {
+            nodes.translations[sampler.node] = SampleVec3Track(*this, sampler.translation, u, cursor.translation);
+        }
+        if (sampler.scale.keyCount > 0) {
+            nodes.scales[sampler.node] = SampleVec3Track(*this, sampler.scale, u, cursor.scale);
+        }
+        if (sampler.rotation.keyCount > 0) {
+            nodes.rotations[sampler.node] = SampleQuatTrack(*this, sampler.rotation, u, cursor.rotation);
+        }
+    }
+}
+
+size_t CompressedAnimation::GetMemorySize() const
+{
+    return samplers.size() * sizeof(CompressedSampler) + times.size() * sizeof(uint16_t) +
+           values.size() * sizeof(uint16_t);
+}
+
+// Rough length of the bone hanging off a joint, used to turn rotation and scale error
+// into a displacement.
+static float GetBoneLength(const NodeHierarchy &nodes, uint32_t node)
+{
+    // Children always come after their parent.
+    float length = 0.0f;
+    for (uint32_t child = node + 1; child < nodes.GetCount(); ++child) {
+        if (nodes.parents[child] == node) {
+            length = glm::max(length, glm::length(nodes.translations[child]));
+        }
+    }
+    if (length == 0.0f) {
+        length = glm::length(nodes.translations[node]);
+    }
+    return length > 0.0f ? length : 1.0f;
+}
+
+// Greedily keeps the longest runs of keys that linear interpolation between the decoded
+// end points reproduces within maxError.
+template <typename T, typename Interpolate, typename Error>
+static void ReduceKeys(const std::vector<float> &keyTimes, const std::vector<T> &raw, const std::vector<T> &decoded,
+                       float maxError, Interpolate interpolate, Error error, std::vector<uint32_t> &outKept)
+{
+    const uint32_t count = (uint32_t)raw.size();
+    outKept.clear();
+    outKept.push_back(0);
+
+    bool constant = true;
+    for (uint32_t k = 1; k < count && constant; ++k) {
+        constant = error(decoded[0], raw[k]) <= maxError;
+    }
+    if (constant) {
+        return;
+    }
+
+    auto fits = [&](uint32_t a, uint32_t b) {
+        float span = keyTimes[b] - keyTimes[a];
+        for (uint32_t k = a + 1; k < b; ++k) {
+            float t = span > 0.0f ? (keyTimes[k] - keyTimes[a]) / span : 0.0f;
+            if (error(interpolate(decoded[a], decoded[b], t), raw[k]) > maxError) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    uint32_t a = 0;
+    while (a + 1 < count) {
+        uint32_t b = a + 1;
+        while (b + 1 < count && fits(a, b + 1)) {
+            ++b;
+        }
+        outKept.push_back(b);
+        a = b;
+    }
+}
+
+static uint16_t QuantizeTime(float time, float duration)
+{
+    float n = duration > 0.0f ? glm::clamp(time / duration, 0.0f, 1.0f) : 0.0f;
+    return (uint16_t)(n * 65535.0f + 0.5f);
+}
+
+// Key times rounded to the 16 bit grid, and the source curve evaluated at those times so
+// that the rounding does not shift keys away from where the curve actually is.
+template <typename T>
+static void GetQuantizedKeys(const AnimationSpline<T> &spline, float duration, std::vector<float> &outKeyTimes,
+                             std::vector<T> &outValues)
+{
+    const uint32_t count = (uint32_t)spline.values.size();
+    outKeyTimes.resize(count);
+    outValues.resize(count);
+
+    uint32_t cursor = 1;
+    for (uint32_t k = 0; k < count; ++k) {
+        outKeyTimes[k] = QuantizeTime(spline.times[k], duration);
+        float time = duration * outKeyTimes[k] / 65535.0f;
+        outValues[k] = EvaluateSpline(spline, time, cursor);
+    }
+}
+
+static void CompressVec3Track(const AnimationSpline<glm::vec3> &spline, float duration, float maxError,
+                              float errorScale, CompressedAnimation &outCompressed, CompressedTrack &outTrack)
+{
+    const uint32_t count = (uint32_t)spline.values.size();
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<float> keyTimes;
+    std::vector<glm::vec3> reference;
+    GetQuantizedKeys(spline, duration, keyTimes, reference);
+
+    glm::vec3 rangeMin = reference[0];
+    glm::vec3 rangeMax = reference[0];
+    for (const auto &value : reference) {
+        rangeMin = glm::min(rangeMin, value);
+        rangeMax = glm::max(rangeMax, value);
+    }
+    outTrack.rangeMin = rangeMin;
+    outTrack.rangeExtent = rangeMax - rangeMin;
+
+    std::vector<uint16_t> packed(count * 3);
+    std::vector<glm::vec3> decoded(count);
+    for (uint32_t k = 0; k < count; ++k) {
+        PackVec3(reference[k], outTrack, &packed[k * 3]);
+        decoded[k] = UnpackVec3(&packed[k * 3], outTrack);
+    }
+
+    auto error = [errorScale](glm::vec3 a, glm::vec3 b) { return glm::length(a - b) * errorScale; };
+    std::vector<uint32_t> kept;
+    ReduceKeys(keyTimes, reference, decoded, maxError, InterpolateVec3, error, kept);
+
+    outTrack.keyOffset = (uint32_t)outCompressed.times.size();
+    outTrack.keyCount = (uint32_t)kept.size();
+    for (uint32_t k : kept) {
+        outCompressed.times.push_back((uint16_t)keyTimes[k]);
+        outCompressed.values.insert(outCompressed.values.end(), &packed[k * 3], &packed[k * 3] + 3);
+    }
+}
+
+static void CompressQuatTrack(const AnimationSpline<glm::quat> &spline, float duration, float maxError,
+                              float boneLength, CompressedAnimation &outCompressed, CompressedTrack &outTrack)
+{
+    const uint32_t count = (uint32_t)spline.values.size();
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<float> keyTimes;
+    std::vector<glm::quat> reference;
+    GetQuantizedKeys(spline, duration, keyTimes, reference);
+
+    std::vector<uint16_t> packed(count * 3);
+    std::vector<glm::quat> decoded(count);
+    for (uint32_t k = 0; k < count; ++k) {
+        reference[k] = glm::normalize(reference[k]);
+        PackQuat(reference[k], &packed[k * 3]);
+        decoded[k] = UnpackQuat(&packed[k * 3]);
+    }
+
+    // For small angles the chord between unit quaternions is half the rotation angle.
+    auto error = [boneLength](glm::quat a, glm::quat b) {
+        if (glm::dot(a, b) < 0.0f) {
+            b = -b;
+        }
+        return 2.0f * glm::length(a - b) * boneLength;
+    };
+    std::vector<uint32_t> kept;
+    ReduceKeys(keyTimes, reference, decoded, maxError, InterpolateQuat, error, kept);
+
+    outTrack.keyOffset = (uint32_t)outCompressed.times.size();
+    outTrack.keyCount = (uint32_t)kept.size();
+    for (uint32_t k : kept) {
+        outCompressed.times.push_back((uint16_t)keyTimes[k]);
+        outCompressed.values.insert(outCompressed.values.end(), &packed[k * 3], &packed[k * 3] + 3);
+    }
+}
+
+bool CompressAnimation(const Animation &animation, const NodeHierarchy &nodes,
+                       const AnimationCompressionSettings &settings, CompressedAnimation &outCompressed,
+                       float &outMaxError)
+{
+    outMaxError = 0.0f;
+    if (!settings.enabled) {
+        return false;
+    }
+
+    outCompressed = {};
+    outCompressed.duration = animation.endTime;
+
+    for (const auto &sampler : animation.samplers) {
+        auto &outSampler = outCompressed.samplers.emplace_back();
+        outSampler.node = sampler.node;
+
+        float boneLength = GetBoneLength(nodes, sampler.node);
+        CompressVec3Track(sampler.translation, animation.endTime, settings.maxError, 1.0f, outCompressed,
+                          outSampler.translation);
+        CompressVec3Track(sampler.scale, animation.endTime, settings.maxError, boneLength, outCompressed,
+                          outSampler.scale);
+        CompressQuatTrack(sampler.rotation, animation.endTime, settings.maxError, boneLength, outCompressed,
+                          outSampler.rotation);
+    }
+
+    // Measure what playback actually produces at every source key.
+    for (uint32_t i = 0; i < animation.samplers.size(); ++i) {
+        const auto &sampler = animation.samplers[i];
+        const auto &compressed = outCompressed.samplers[i];
+        float boneLength = GetBoneLength(nodes, sampler.node);
+
+        const AnimationSpline<glm::vec3> *vec3Splines[] = {&sampler.translation, &sampler.scale};
+        const CompressedTrack *vec3Tracks[] = {&compressed.translation, &compressed.scale};
+        const float vec3Scales[] = {1.0f, boneLength};
+        for (uint32_t path = 0; path < 2; ++path) {
+            const auto &spline = *vec3Splines[path];
+            uint32_t cursor = 1;
+            for (uint32_t k = 0; k < spline.values.size(); ++k) {
+                float u = GetCompressedTime(outCompressed, spline.times[k]);
+                glm::vec3 value = SampleVec3Track(outCompressed, *vec3Tracks[path], u, cursor);
+                outMaxError = glm::max(outMaxError, glm::length(value - spline.values[k]) * vec3Scales[path]);
+            }
+        }
+
+        uint32_t cursor = 1;
+        for (uint32_t k = 0; k < sampler.rotation.values.size(); ++k) {
+            float u = GetCompressedTime(outCompressed, sampler.rotation.times[k]);
+            glm::quat value = SampleQuatTrack(outCompressed, compressed.rotation, u, cursor);
+            glm::quat expected = glm::normalize(sampler.rotation.values[k]);
+            if (glm::dot(value, expected) < 0.0f) {
+                value = -value;
+            }
+            outMaxError = glm::max(outMaxError, 2.0f * glm::length(value - expected) * boneLength);
+        }
+    }
+
+    return true;
+}
+
+//
+// Batch sampling
+//
+
+#if defined(__AVX__)
+#define BATCH_WIDTH 8
+typedef __m256 BatchFloat;
+static inline BatchFloat BatchLoad(const float *p)
+{
+    return _mm256_loadu_ps(p);
+}
+static inline void BatchStore(float *p, BatchFloat v)
+{
+    _mm256_storeu_ps(p, v);
+}
+static inline BatchFloat BatchSet(float v)
+{
+    return _mm256_set1_ps(v);
+}
+static inline BatchFloat BatchAdd(BatchFloat a, BatchFloat b)
+{
+    return _mm256_add_ps(a, b);
+}
+static inline BatchFloat BatchMul(BatchFloat a, BatchFloat b)
+{
+    return _mm256_mul_ps(a, b);
+}
+static inline BatchFloat BatchDiv(BatchFloat a, BatchFloat b)
+{
+    return _mm256_div_ps(a, b);
+}
+static inline BatchFloat BatchSqrt(BatchFloat a)
+{
+    return _mm256_sqrt_ps(a);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#define BATCH_WIDTH 4
+typedef __m128 BatchFloat;
+static inline BatchFloat BatchLoad(const float *p)
+{
+    return _mm_loadu_ps(p);
+}
+static inline void BatchStore(float *p, BatchFloat v)
+{
+    _mm_storeu_ps(p, v);
+}
+static inline BatchFloat BatchSet(float v)
+{
+    return _mm_set1_ps(v);
+}
+static inline BatchFloat BatchAdd(BatchFloat a, BatchFloat b)
+{
+    return _mm_add_ps(a, b);
+}
+static inline BatchFloat BatchMul(BatchFloat a, BatchFloat b)
+{
+    return _mm_mul_ps(a, b);
+}
+static inline BatchFloat BatchDiv(BatchFloat a, BatchFloat b)
+{
+    return _mm_div_ps(a, b);
+}
+static inline BatchFloat BatchSqrt(BatchFloat a)
+{
+    return _mm_sqrt_ps(a);
+}
+#else
+// Plain lanes, simple enough for the compiler to turn into NEON on ARM.
+#define BATCH_WIDTH 4
+struct BatchFloat
+{
+    float v[BATCH_WIDTH];
+};
+static inline BatchFloat BatchLoad(const float *p)
+{
+    BatchFloat r;
+    for (int i = 0; i < BATCH_WIDTH; ++i)
+        r.v[i] = p[i];
+    return r;
+}
+static inline void BatchStore(float *p, BatchFloat a)
+{
+    for (int i = 0; i < BATCH_WIDTH; ++i)
+        p[i] = a.v[i];
+}
+static inline BatchFloat BatchSet(float v)
+{
+    BatchFloat r;
+    for (int i = 0; i < BATCH_WIDTH; ++i)
+        r.v[i] = v;
+    return r;
+}
+#define BATCH_OP(name, expr)                                                                                           \
+    static inline BatchFloat name(BatchFloat a, BatchFloat b)                                                          \
+    {                                                                                                                  \
+        BatchFloat r;                                                                                                  \
+        for (int i = 0; i < BATCH_WIDTH; ++i)                                                                          \
+            r.v[i] = expr;                                                                                             \
+        return r;                                                                                                      \
+    }
+BATCH_OP(BatchAdd, a.v[i] + b.v[i])
+BATCH_OP(BatchMul, a.v[i] * b.v[i])
+BATCH_OP(BatchDiv, a.v[i] / b.v[i])
+#undef BATCH_OP
+static inline BatchFloat BatchSqrt(BatchFloat a)
+{
+    BatchFloat r;
+    for (int i = 0; i < BATCH_WIDTH; ++i)
+        r.v[i] = sqrtf(a.v[i]);
+    return r;
+}
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(__AVX__)
+// Transposes four lanes of x, y, z streams into vec3s scattered through the node arrays.
+static inline void StoreVec3x4(const __m128 *v, const uint32_t *indices, glm::vec3 *out)
+{
+    __m128 r0 = v[0], r1 = v[1], r2 = v[2], r3 = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    const __m128 rows[] = {r0, r1, r2, r3};
+    for (uint32_t lane = 0; lane < 4; ++lane) {
+        float *dst = &out[indices[lane]].x;
+        _mm_storel_pi((__m64 *)dst, rows[lane]);
+        _mm_store_ss(dst + 2, _mm_movehl_ps(rows[lane], rows[lane]));
+    }
+}
+
+// glm::quat is laid out x, y, z, w which is exactly a transposed row.
+static inline void StoreQuatx4(const __m128 *v, const uint32_t *indices, glm::quat *out)
+{
+    __m128 x = v[0], y = v[1], z = v[2], w = v[3];
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+    _mm_storeu_ps(&out[indices[0]].x, x);
+    _mm_storeu_ps(&out[indices[1]].x, y);
+    _mm_storeu_ps(&out[indices[2]].x, z);
+    _mm_storeu_ps(&out[indices[3]].x, w);
+}
+#endif
+
+template <uint32_t Components, typename T>
+static inline void BatchStoreLanes(const BatchFloat *v, const uint32_t *indices, uint32_t count, T *out)
+{
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+    if (count == BATCH_WIDTH) {
+#if defined(__AVX__)
+        __m128 halves[2][Components];
+        for (uint32_t c = 0; c < Components; ++c) {
+            halves[0][c] = _mm256_castps256_ps128(v[c]);
+            halves[1][c] = _mm256_extractf128_ps(v[c], 1);
+        }
+#else
+        const __m128 *halves[1] = {v};
+#endif
+        for (uint32_t half = 0; half < BATCH_WIDTH / 4; ++half) {
+            if constexpr (Components == 3) {
+                StoreVec3x4(halves[half], indices + half * 4, out);
+            } else {
+                StoreQuatx4(halves[half], indices + half * 4, out);
+            }
+        }
+        return;
+    }
+#endif
+
+    float lanes[Components][BATCH_WIDTH];
+    for (uint32_t c = 0; c < Components; ++c) {
+        BatchStore(lanes[c], v[c]);
+    }
+    for (uint32_t lane = 0; lane < count; ++lane) {
+        float *dst = &out[indices[lane]].x;
+        for (uint32_t c = 0; c < Components; ++c) {
+            dst[c] = lanes[c][lane];
+        }
+    }
+}
+
+static_assert(ANIMATION_BATCH_LANES % BATCH_WIDTH == 0, "Batch lanes must be a multiple of the SIMD width");
+
+size_t BatchAnimation::GetMemorySize() const
+{
+    size_t size = 0;
+    for (const auto *group : {&translations, &scales, &rotations}) {
+        size += group->frames.size() * sizeof(float) + group->nodes.size() * sizeof(uint32_t);
+    }
+    return size;
+}
+
+static void InitBatchGroup(uint32_t components, uint32_t frameCount, const std::vector<uint32_t> &nodes,
+                           BatchGroup &outGroup)
+{
+    outGroup.components = components;
+    outGroup.laneCount =
+        ((uint32_t)nodes.size() + ANIMATION_BATCH_LANES - 1) / ANIMATION_BATCH_LANES * ANIMATION_BATCH_LANES;
+    outGroup.nodes = nodes;
+    // Padding lanes are left at zero, they are blended but never stored. The rotation
+    // group gets w = 1 in them so normalizing stays finite.
+    outGroup.frames.assign(frameCount * components * outGroup.laneCount, 0.0f);
+    if (components == 4) {
+        for (uint32_t f = 0; f < frameCount; ++f) {
+            float *w = &outGroup.frames[(f * components + 3) * outGroup.laneCount];
+            for (uint32_t lane = (uint32_t)nodes.size(); lane < outGroup.laneCount; ++lane) {
+                w[lane] = 1.0f;
+            }
+        }
+    }
+}
+
+bool BuildBatchAnimation(const Animation &animation, BatchAnimation &outBatch)
+{
+    const auto &baked = animation.baked;
+    if (baked.frameCount == 0) {
+        return false;
+    }
+
+    outBatch.sampleRate = baked.sampleRate;
+    outBatch.frameCount = baked.frameCount;
+
+    std::vector<uint32_t> translationNodes, scaleNodes, rotationNodes;
+    std::vector<uint32_t> vec3Lanes;
+    for (const auto &channel : baked.vec3Channels) {
+        auto &nodes = channel.path == AnimationPath_Translation ? translationNodes : scaleNodes;
+        vec3Lanes.push_back((uint32_t)nodes.size());
+        nodes.push_back(channel.node);
+    }
+    for (const auto &channel : baked.quatChannels) {
+        rotationNodes.push_back(channel.node);
+    }
+
+    InitBatchGroup(3, baked.frameCount, translationNodes, outBatch.translations);
+    InitBatchGroup(3, baked.frameCount, scaleNodes, outBatch.scales);
+    InitBatchGroup(4, baked.frameCount, rotationNodes, outBatch.rotations);
+
+    auto write = [](BatchGroup &group, uint32_t frame, uint32_t lane, const float *values) {
+        float *dst = &group.frames[frame * group.components * group.laneCount + lane];
+        for (uint32_t c = 0; c < group.components; ++c) {
+            dst[c * group.laneCount] = values[c];
+        }
+    };
+
+    const uint32_t vec3Count = (uint32_t)baked.vec3Channels.size();
+    const uint32_t quatCount = (uint32_t)baked.quatChannels.size();
+    for (uint32_t f = 0; f < baked.frameCount; ++f) {
+        for (uint32_t i = 0; i < vec3Count; ++i) {
+            bool translation = baked.vec3Channels[i].path == AnimationPath_Translation;
+            auto &group = translation ? outBatch.translations : outBatch.scales;
+            write(group, f, vec3Lanes[i], &baked.vec3Values[f * vec3Count + i].x);
+        }
+        for (uint32_t i = 0; i < quatCount; ++i) {
+            write(outBatch.rotations, f, i, &baked.quatValues[f * quatCount + i].x);
+        }
+    }
+
+    return true;
+}
+
+// Same operation order as glm::mix and glm::normalize so the pose matches the scalar
+// baked path.
+template <uint32_t Components, typename T>
+static void SampleBatchGroup(const BatchGroup &group, uint32_t f0, uint32_t f1, float t, T *out)
+{
+    const uint32_t frameSize = Components * group.laneCount;
+    const float *frame0 = group.frames.data() + f0 * frameSize;
+    const float *frame1 = group.frames.data() + f1 * frameSize;
+    const BatchFloat w0 = BatchSet(1.0f - t);
+    const BatchFloat w1 = BatchSet(t);
+    const uint32_t nodeCount = (uint32_t)group.nodes.size();
+
+    for (uint32_t base = 0; base < nodeCount; base += BATCH_WIDTH) {
+        BatchFloat v[Components];
+        for (uint32_t c = 0; c < Components; ++c) {
+            const uint32_t offset = c * group.laneCount + base;
+            v[c] = BatchAdd(BatchMul(BatchLoad(frame0 + offset), w0), BatchMul(BatchLoad(frame1 + offset), w1));
+        }
+
+        if constexpr (Components == 4) {
+            BatchFloat &x = v[0], &y = v[1], &z = v[2], &w = v[3];
+            BatchFloat lengthSq =
+                BatchAdd(BatchAdd(BatchMul(w, w), BatchMul(x, x)), BatchAdd(BatchMul(y, y), BatchMul(z, z)));
+            BatchFloat inverseLength = BatchDiv(BatchSet(1.0f), BatchSqrt(lengthSq));
+            x = BatchMul(x, inverseLength);
+            y = BatchMul(y, inverseLength);
+            z = BatchMul(z, inverseLength);
+            w = BatchMul(w, inverseLength);
+        }
+
+        uint32_t count = glm::min((uint32_t)BATCH_WIDTH, nodeCount - base);
+        BatchStoreLanes<Components>(v, &group.nodes[base], count, out);
+    }
+}
+
+void BatchAnimation::Sample(float time, NodeHierarchy &nodes) const
+{
+    uint32_t f0, f1;
+    float t;
+    GetUniformFrames(time, sampleRate, frameCount, f0, f1, t);
+
+    SampleBatchGroup<3>(translations, f0, f1, t, nodes.translations.data());
+    SampleBatchGroup<3>(scales, f0, f1, t, nodes.scales.data());
+    SampleBatchGroup<4>(rotations, f0, f1, t, nodes.rotations.data());
+}
+
+//
+// Pose cache
+//
+
+void PoseCache::BeginFrame(const PoseCacheSettings &settings)
+{
+    m_frame++;
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (m_frame - it->second.lastUsedFrame > settings.maxIdleFrames) {
+            it = m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+const CachedPose *PoseCache::Find(const PoseCacheKey &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        return nullptr;
+    }
+    it->second.lastUsedFrame = m_frame;
+    return &it->second;
+}
+
+void PoseCache::Insert(const PoseCacheKey &key, CachedPose &&pose)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto [it, inserted] = m_entries.try_emplace(key);
+    if (inserted) {
+        it->second.pose = std::move(pose.pose);
+    }
+    it->second.lastUsedFrame = m_frame;
+}
+
+void PoseCache::Clear()
+{
+    m_entries.clear();
+}
+
+//
+// Sampling benchmark
+//
+
+// Plays the whole spline at frameRate the way instances do and returns samples per microsecond. The
+// sum keeps the compiler from dropping the lookups.
+template <typename Sample>
+static double TimeSplinePlayback(uint32_t frameCount, float frameRate, Sample sample, glm::vec3 &outSum)
+{
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    double seconds = 0.0;
+    uint64_t samples = 0;
+    // At least 20 ms per method so timer resolution doesn't matter.
+    while (seconds < 0.02) {
+        outSum += sample(frameCount, frameRate);
+        samples += frameCount;
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return (double)samples / (seconds * 1e6);
+}
+
+void BenchmarkAnimationSampling()
+{
+    const uint32_t keyCounts[] = {30, 300, 3000};
+    const float keyRate = 30.0f;
+    const float frameRate = 60.0f;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+
+    printf("Animation sampling, %.0f Hz keys played at %.0f fps, samples per us:\n", keyRate, frameRate);
+    for (uint32_t keyCount : keyCounts) {
+        // Key times are jittered by less than half a key so they stay sorted.
+        AnimationSpline<glm::vec3> spline;
+        spline.method = InterpolationMethod_Linear;
+        for (uint32_t k = 0; k < keyCount; ++k) {
+            spline.times.push_back(((float)k + 0.25f * (distribution(random) + 1.0f)) / keyRate);
+            spline.values.push_back(glm::vec3(distribution(random), distribution(random), distribution(random)));
+        }
+        const uint32_t frameCount = (uint32_t)(spline.times.back() * frameRate);
+
+        auto scan = [&](uint32_t count, float rate) {
+            glm::vec3 sum = glm::vec3(0);
+            for (uint32_t f = 0; f < count; ++f) {
+                glm::vec3 value = spline.values.back();
+                spline.GetValueAtTime((float)f / rate, value);
+                sum += value;
+            }
+            return sum;
+        };
+        auto cursor = [&](uint32_t count, float rate) {
+            glm::vec3 sum = glm::vec3(0);
+            uint32_t key = 0;
+            for (uint32_t f = 0; f < count; ++f) {
+                sum += EvaluateSpline(spline, (float)f / rate, key);
+            }
+            return sum;
+        };
+
+        // Both have to agree on every frame before their timings mean anything.
+        float maxError = 0.0f;
+        uint32_t key = 0;
+        for (uint32_t f = 0; f < frameCount; ++f) {
+            const float time = (float)f / frameRate;
+            glm::vec3 expected = spline.values.back();
+            spline.GetValueAtTime(time, expected);
+            maxError = glm::max(maxError, glm::length(EvaluateSpline(spline, time, key) - expected));
+        }
+
+        glm::vec3 sum = glm::vec3(0);
+        const double scanRate = TimeSplinePlayback(frameCount, frameRate, scan, sum);
+        const double cursorRate = TimeSplinePlayback(frameCount, frameRate, cursor, sum);
+        volatile float sink = sum.x + sum.y + sum.z;
+        (void)sink;
+        printf("  %4u keys: scan %.1f cursor %.1f (%.1fx, err %.1e)\n", keyCount, scanRate, cursorRate,
+               cursorRate / scanRate, maxError);
+    }
+}
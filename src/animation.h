@@ -0,0 +1,404 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+enum NodeDirtyFlags
+{
+    NodeDirty_Local = 1 << 0,
+    NodeDirty_World = 1 << 1,
+};
+
+// Nodes of a model as flat arrays sorted by depth, so a parent always comes before its
+// children and world matrices are a single linear pass.
+//
+// Anything writing translations, scales or rotations directly has to call MarkDirty, only
+// dirty nodes and their subtrees are recomputed.
+struct NodeHierarchy
+{
+    uint32_t AddNode(uint32_t parent);
+    // Returns how many world matrices were recomputed.
+    uint32_t UpdateWorldMatrices();
+
+    inline uint32_t GetCount() const
+    {
+        return (uint32_t)parents.size();
+    }
+    inline glm::mat4 GetLocalMatrix(uint32_t node) const
+    {
+        return glm::translate(glm::mat4(1), translations[node]) * glm::scale(glm::mat4(1), scales[node]) *
+               glm::mat4_cast(rotations[node]) * matrices[node];
+    }
+    inline void MarkDirty(uint32_t node)
+    {
+        dirty[node] |= NodeDirty_Local;
+    }
+    inline void SetTranslation(uint32_t node, glm::vec3 translation)
+    {
+        translations[node] = translation;
+        MarkDirty(node);
+    }
+    inline void SetScale(uint32_t node, glm::vec3 scale)
+    {
+        scales[node] = scale;
+        MarkDirty(node);
+    }
+    inline void SetRotation(uint32_t node, glm::quat rotation)
+    {
+        rotations[node] = rotation;
+        MarkDirty(node);
+    }
+
+    std::vector<uint32_t> parents; // UINT32_MAX for roots
+    std::vector<glm::vec3> translations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::mat4> matrices;
+    std::vector<glm::mat4> localMatrices;
+    std::vector<glm::mat4> worldMatrices;
+    std::vector<uint8_t> dirty;
+    std::vector<uint32_t> meshIndices;
+    std::vector<uint32_t> skinIndices;
+};
+
+enum InterpolationMethod
+{
+    InterpolationMethod_Linear = 0,
+};
+
+template <typename T> struct AnimationSpline
+{
+    void GetValueAtTime(float time, T &outValue) const;
+    void GetValueAtTime(float time, T &outValue, uint32_t &cursor) const;
+
+    // Returns the first key after `time`, or UINT32_MAX once the spline has ended.
+    uint32_t FindKey(float time, uint32_t &cursor) const;
+    void Interpolate(uint32_t key, float time, T &outValue) const;
+
+    std::vector<T> values;
+    std::vector<float> times;
+    InterpolationMethod method;
+};
+
+template <> inline void AnimationSpline<glm::quat>::Interpolate(uint32_t key, float time, glm::quat &outValue) const
+{
+    assert(method == InterpolationMethod_Linear && "Unhandled interpolation method");
+
+    auto v0 = values[key - 1];
+    auto v1 = values[key];
+    auto t0 = times[key - 1];
+    auto t1 = times[key];
+
+    float t = (time - t0) / (t1 - t0);
+    outValue = glm::normalize(glm::slerp(v0, v1, t));
+}
+
+template <typename T> inline void AnimationSpline<T>::Interpolate(uint32_t key, float time, T &outValue) const
+{
+    assert(method == InterpolationMethod_Linear && "Unhandled interpolation method");
+
+    auto v0 = values[key - 1];
+    auto v1 = values[key];
+    auto t0 = times[key - 1];
+    auto t1 = times[key];
+
+    float t = (time - t0) / (t1 - t0);
+    outValue = glm::mix(v0, v1, t);
+}
+
+template <typename T> inline uint32_t AnimationSpline<T>::FindKey(float time, uint32_t &cursor) const
+{
+    const uint32_t count = (uint32_t)times.size();
+
+    // During playback time only moves forward by a fraction of a key per frame, so the
+    // segment from last frame (or the one right after it) is almost always the answer.
+    for (uint32_t i = std::max(cursor, 1u); i < count && i <= cursor + 1; ++i) {
+        if (times[i] > time && (i == 1 || times[i - 1] <= time)) {
+            cursor = i;
+            return i;
+        }
+    }
+
+    // Seek or wrap around.
+    if (count < 2) {
+        return UINT32_MAX;
+    }
+    auto it = std::upper_bound(times.begin() + 1, times.end(), time);
+    if (it == times.end()) {
+        return UINT32_MAX;
+    }
+    cursor = (uint32_t)(it - times.begin());
+    return cursor;
+}
+
+template <typename T> inline void AnimationSpline<T>::GetValueAtTime(float time, T &outValue) const
+{
+    for (uint32_t i = 1; i < values.size(); ++i) {
+        if (times[i] > time) {
+            Interpolate(i, time, outValue);
+            break;
+        }
+    }
+}
+
+template <typename T> inline void AnimationSpline<T>::GetValueAtTime(float time, T &outValue, uint32_t &cursor) const
+{
+    uint32_t key = FindKey(time, cursor);
+    if (key != UINT32_MAX) {
+        Interpolate(key, time, outValue);
+    }
+}
+
+struct AnimationSampler
+{
+    // Index into the model's NodeHierarchy.
+    uint32_t node = UINT32_MAX;
+
+    AnimationSpline<glm::vec3> scale;
+    AnimationSpline<glm::vec3> translation;
+    AnimationSpline<glm::quat> rotation;
+};
+
+// Last key used by each channel of a sampler, kept per playing model so that
+// instances sharing a clip do not fight over it.
+struct AnimationCursor
+{
+    uint32_t scale = 1;
+    uint32_t translation = 1;
+    uint32_t rotation = 1;
+};
+
+enum AnimationSampling
+{
+    // Linear scan from the first key, kept around as a reference.
+    AnimationSampling_Scan = 0,
+    AnimationSampling_Cursor,
+    // Uniform-rate tracks from BakeAnimation, falls back to the cursor lookup for clips
+    // that were not baked.
+    AnimationSampling_Baked,
+    // Quantized, key-reduced tracks from CompressAnimation, same fallback as baked.
+    AnimationSampling_Compressed,
+    // Baked clip transposed to structure-of-arrays and sampled several samplers at a time.
+    AnimationSampling_Batch,
+    AnimationSampling_Count,
+};
+
+inline const char *GetAnimationSamplingName(AnimationSampling sampling)
+{
+    switch (sampling) {
+    case AnimationSampling_Scan:
+        return "scan";
+    case AnimationSampling_Cursor:
+        return "cursor";
+    case AnimationSampling_Baked:
+        return "baked";
+    case AnimationSampling_Compressed:
+        return "compressed";
+    case AnimationSampling_Batch:
+        return "batch";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+struct AnimationBakeSettings
+{
+    // Frames per second of the baked tracks, 0 keeps the raw keyframes.
+    float sampleRate = 0.0f;
+    // Largest error allowed against the raw keyframes, in model units for translation
+    // and scale and radians for rotation. The rate is doubled until the clip fits.
+    float maxError = 0.001f;
+    float maxRotationError = 0.001f;
+    float maxSampleRate = 240.0f;
+};
+
+struct AnimationCompressionSettings
+{
+    bool enabled = false;
+    // Keys are dropped while the displacement of a point one bone length away from the
+    // joint stays under this, in model units. Quantization error is included.
+    float maxError = 0.0001f;
+};
+
+enum AnimationPath
+{
+    AnimationPath_Translation = 0,
+    AnimationPath_Scale,
+    AnimationPath_Rotation,
+};
+
+struct BakedChannel
+{
+    uint32_t node;
+    AnimationPath path;
+};
+
+// Clip resampled at a fixed rate. Values are stored frame-major so a sample reads two
+// neighbouring blocks, only channels that are animated in the source clip are kept.
+struct BakedAnimation
+{
+    void GetFrames(float time, uint32_t &outFrame0, uint32_t &outFrame1, float &outT) const;
+    void Sample(float time, NodeHierarchy &nodes) const;
+    size_t GetMemorySize() const;
+
+    float sampleRate = 0.0f;
+    uint32_t frameCount = 0;
+    std::vector<BakedChannel> vec3Channels;
+    std::vector<BakedChannel> quatChannels;
+    std::vector<glm::vec3> vec3Values; // frameCount * vec3Channels.size()
+    std::vector<glm::quat> quatValues; // frameCount * quatChannels.size()
+};
+
+struct CompressedTrack
+{
+    uint32_t keyOffset = 0;
+    uint32_t keyCount = 0;
+    // Dequantization range of translation and scale keys, unused for rotation.
+    glm::vec3 rangeMin = glm::vec3(0);
+    glm::vec3 rangeExtent = glm::vec3(0);
+};
+
+struct CompressedSampler
+{
+    uint32_t node;
+    CompressedTrack translation;
+    CompressedTrack scale;
+    CompressedTrack rotation;
+};
+
+// Clip with keyframes removed where linear interpolation stays within the error bound.
+// Each remaining key is a 16 bit time plus three 16 bit values, either a position in
+// the track range or a smallest-three quaternion. Samplers line up with the source clip
+// so the same cursors are used.
+struct CompressedAnimation
+{
+    void Sample(float time, AnimationCursor *cursors, NodeHierarchy &nodes) const;
+    size_t GetMemorySize() const;
+
+    float duration = 0.0f;
+    std::vector<CompressedSampler> samplers;
+    std::vector<uint16_t> times;  // normalized to duration
+    std::vector<uint16_t> values; // 3 per key
+};
+
+// Sampler count is padded to this so the widest batch never reads past a frame.
+#define ANIMATION_BATCH_LANES 8
+
+// Local TRS of every sampler of a clip, indexed like Animation::samplers.
+struct AnimationPose
+{
+    std::vector<glm::vec3> translations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::quat> rotations;
+};
+
+// One channel type of a baked clip as structure-of-arrays. Every frame holds `components`
+// streams of laneCount floats and lane i drives node nodes[i].
+struct BatchGroup
+{
+    uint32_t components = 0;
+    uint32_t laneCount = 0;
+    std::vector<uint32_t> nodes;
+    std::vector<float> frames; // frameCount * components * laneCount
+};
+
+// Baked clip laid out for SIMD, each group is sampled several channels at a time.
+struct BatchAnimation
+{
+    void Sample(float time, NodeHierarchy &nodes) const;
+    size_t GetMemorySize() const;
+
+    float sampleRate = 0.0f;
+    uint32_t frameCount = 0;
+    BatchGroup translations;
+    BatchGroup scales;
+    BatchGroup rotations;
+};
+
+// Since animations work on specific node they cannot be shared between models,
+// so even thougth they create a cyclical dependency it makes sense.
+struct Animation
+{
+    size_t GetMemorySize() const;
+
+    std::vector<AnimationSampler> samplers;
+    float endTime;
+
+    BakedAnimation baked;
+    CompressedAnimation compressed;
+    BatchAnimation batch;
+};
+
+struct PoseCacheSettings
+{
+    bool enabled = true;
+    // Sample times are snapped to this rate so instances close in time share a pose.
+    float sampleRate = 60.0f;
+    // Entries nobody looked up for this many frames are dropped.
+    uint32_t maxIdleFrames = 8;
+};
+
+struct PoseCacheKey
+{
+    const Animation *animation = nullptr;
+    uint32_t frame = 0;
+    AnimationSampling sampling = AnimationSampling_Scan;
+
+    bool operator==(const PoseCacheKey &other) const = default;
+};
+
+struct PoseCacheKeyHash
+{
+    size_t operator()(const PoseCacheKey &key) const
+    {
+        size_t hash = std::hash<const void *>()(key.animation);
+        hash ^= ((size_t)key.frame << 8 | key.sampling) * 0x9e3779b97f4a7c15ull;
+        return hash;
+    }
+};
+
+// Local pose, independent of where the instance is placed.
+struct CachedPose
+{
+    AnimationPose pose;
+    uint32_t lastUsedFrame = 0;
+};
+
+// Find and Insert may be called from several threads. Entries are never changed once
+// inserted and only BeginFrame removes them, so a found entry can be read without the lock.
+class PoseCache
+{
+  public:
+    void BeginFrame(const PoseCacheSettings &settings);
+    const CachedPose *Find(const PoseCacheKey &key);
+    // Keeps the existing entry if another thread got there first.
+    void Insert(const PoseCacheKey &key, CachedPose &&pose);
+    void Clear();
+
+    inline size_t GetSize() const
+    {
+        return m_entries.size();
+    }
+
+  private:
+    std::unordered_map<PoseCacheKey, CachedPose, PoseCacheKeyHash> m_entries;
+    std::mutex m_mutex;
+    uint32_t m_frame = 0;
+};
+
+bool BakeAnimation(const Animation &animation, const AnimationBakeSettings &settings, BakedAnimation &outBaked);
+bool BuildBatchAnimation(const Animation &animation, BatchAnimation &outBatch);
+bool CompressAnimation(const Animation &animation, const NodeHierarchy &nodes,
+                       const AnimationCompressionSettings &settings, CompressedAnimation &outCompressed,
+                       float &outMaxError);
+
+// Prints samples per microsecond of the linear scan and the cursor lookup over a few clip lengths.
+void BenchmarkAnimationSampling();
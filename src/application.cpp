@@ -4,6 +4,36 @@ static void GlfwKeyCallback(GLFWwindow *window, int key, int scancode, int actio
 {
     if (key == GLFW_KEY_W && action == GLFW_PRESS && (mods & GLFW_MOD_SUPER))
         Application::Get().StopRunning();
+    if (key == GLFW_KEY_C && action == GLFW_PRESS)
+        Application::Get().ToggleAnimationSampling();
+    if (key == GLFW_KEY_X && action == GLFW_PRESS)
+        BenchmarkAnimationSampling();
+    if (key == GLFW_KEY_L && action == GLFW_PRESS)
+        Application::Get().ToggleAnimationLod();
+    if (key == GLFW_KEY_P && action == GLFW_PRESS)
+        Application::Get().TogglePoseCache();
+    if (key == GLFW_KEY_J && action == GLFW_PRESS)
+        Application::Get().ToggleParallelUpdate();
+    if (key == GLFW_KEY_T && action == GLFW_PRESS)
+        Application::Get().TogglePipelined();
+    if (key == GLFW_KEY_K && action == GLFW_PRESS)
+        Application::Get().ToggleSkinningMode();
+    if (key == GLFW_KEY_RIGHT_BRACKET && action == GLFW_PRESS)
+        Application::Get().AddPasses(1);
+    if (key == GLFW_KEY_LEFT_BRACKET && action == GLFW_PRESS)
+        Application::Get().AddPasses(-1);
+    if (key == GLFW_KEY_V && action == GLFW_PRESS)
+        Application::Get().TogglePaletteKernel();
+    if (key == GLFW_KEY_B && action == GLFW_PRESS)
+        BenchmarkPaletteKernels();
+    if (key == GLFW_KEY_G && action == GLFW_PRESS)
+        Application::Get().ToggleGpuDriven();
+    if (key == GLFW_KEY_O && action == GLFW_PRESS)
+        Application::Get().ToggleMeshLod();
+    if (key == GLFW_KEY_N && action == GLFW_PRESS)
+        Application::Get().AddInstances(16);
+    if (key == GLFW_KEY_M && action == GLFW_PRESS)
+        Application::Get().AddInstances(-16);
 }
 
 static void GlfwErrorCallback(int code, const char *message)
@@ -29,7 +59,7 @@ bool Application::Run()
     }
     glfwSetKeyCallback(m_window, GlfwKeyCallback);
 
-    if (!m_renderer.Init(m_window)) {
+    if (!m_renderer.Init(m_window) || !LoadScene()) {
         return false;
     }
 
@@ -49,7 +79,27 @@ bool Application::Run()
         }
 
         char windowTitle[1024] = {};
-        snprintf(windowTitle, sizeof(windowTitle), "%f ms | %f fps", dt, 1 / dt);
+        const auto &stats = m_renderer.GetStats();
+        const auto &memory = m_renderer.GetMemoryStats();
+        snprintf(windowTitle, sizeof(windowTitle),
+                 "%f ms | %f fps | anim %.3f ms (%s) | lod %s %u/%u/%u/%u/%u vat, %u late | poses %u hit %u miss"
+                 " | nodes %u/%u | %u threads%s | gpu %.3f ms | %s skinning %u verts x%u passes"
+                 " | palettes %u B (%s) | %u instances, %u draws%s | culled %u instances, %u/%u primitives"
+                 " | mesh lod %u/%u/%u/%u | memory %u allocs in %u blocks + %u dedicated, %.1f/%.1f MiB,"
+                 " %.0f%% fragmented",
+                 dt, 1 / dt, stats.animationMs, GetAnimationSamplingName(m_renderer.GetAnimationSampling()),
+                 m_renderer.GetAnimationLodSettings().enabled ? "on" : "off", stats.animationLods[AnimationLod_Full],
+                 stats.animationLods[AnimationLod_Half], stats.animationLods[AnimationLod_Quarter],
+                 stats.animationLods[AnimationLod_Paused], stats.animationLods[AnimationLod_Vat],
+                 stats.animationDemotions, stats.poseCacheHits, stats.poseCacheMisses, stats.nodesUpdated,
+                 stats.nodeCount, stats.jobThreads, m_renderer.GetPipelined() ? " | pipelined" : "", stats.gpuMs,
+                 GetSkinningModeName(m_renderer.GetSkinningMode()), stats.skinnedVertices, m_renderer.GetPassCount(),
+                 stats.paletteBytes, GetPaletteKernelName(m_renderer.GetPaletteKernel()), stats.instances,
+                 stats.drawCalls, m_renderer.GetGpuDriven() ? " (gpu driven)" : "", stats.instancesCulled,
+                 stats.primitivesCulled, stats.primitivesDrawn + stats.primitivesCulled, stats.meshLods[0],
+                 stats.meshLods[1], stats.meshLods[2], stats.meshLods[3], memory.allocationCount, memory.blockCount,
+                 memory.deviceMemoryCount - memory.blockCount, memory.usedBytes / (1024.0 * 1024.0),
+                 (memory.blockBytes + memory.dedicatedBytes) / (1024.0 * 1024.0), memory.fragmentation * 100.0f);
         glfwSetWindowTitle(m_window, windowTitle);
     }
 
@@ -59,3 +109,54 @@ bool Application::Run()
     glfwTerminate();
     return true;
 }
+
+bool Application::LoadScene()
+{
+#if 0
+    // TODO: This is broken because pipeline expect some kind of skin to be bound. So either bind a default 
+    // NULL-skin or create another pipeline.
+    if (!m_renderer.LoadModel("./assets/DamagedHelmet.glb", {}, m_asset)) {
+        return false;
+    }
+#else
+#if 1
+    ModelLoadOptions options = {};
+    options.bake.sampleRate = 30.0f;
+    options.compression.enabled = true;
+    options.vat.enabled = true;
+    if (!m_renderer.LoadModel("./assets/clone_trooper_dancing_clone_wars_style.glb", options, m_asset)) {
+        printf("Error loading model\n");
+        return false;
+    }
+#else
+    if (!m_renderer.LoadModel("./assets/RiggedFigure.glb", {}, m_asset)) {
+        return false;
+    }
+#endif
+#endif
+
+    AddInstances(1);
+    return true;
+}
+
+// Rows of 16 going away from the camera, the first instance sits at the origin.
+void Application::AddInstances(int count)
+{
+    if (!m_asset) {
+        return;
+    }
+
+    const float spacing = m_asset->boundsRadius * 2.0f;
+    for (; count > 0; --count) {
+        const uint32_t n = (uint32_t)m_instances.size();
+        const uint32_t column = n % 16;
+        const float x = (float)((column + 1) / 2) * (column % 2 ? 1.0f : -1.0f) * spacing;
+        const float z = -(float)(n / 16) * spacing;
+        m_instances.push_back(
+            m_renderer.CreateModelInstance(m_asset, glm::translate(glm::mat4(1), glm::vec3(x, 0.0f, z))));
+    }
+    for (; count < 0 && m_instances.size() > 1; ++count) {
+        m_renderer.DestroyModelInstance(m_instances.back());
+        m_instances.pop_back();
+    }
+}
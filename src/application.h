@@ -19,13 +19,70 @@ class Application
         return app;
     }
     bool Run();
+    // Press N and M to add or remove a row of instances of the loaded model.
+    void AddInstances(int count);
     inline void StopRunning()
     {
         m_running = false;
     };
+    inline void ToggleAnimationSampling()
+    {
+        // Press C to cycle through the sampling paths and compare their cost.
+        auto sampling = (AnimationSampling)((m_renderer.GetAnimationSampling() + 1) % AnimationSampling_Count);
+        m_renderer.SetAnimationSampling(sampling);
+    }
+    inline void ToggleAnimationLod()
+    {
+        auto &settings = m_renderer.GetAnimationLodSettings();
+        settings.enabled = !settings.enabled;
+    }
+    inline void ToggleParallelUpdate()
+    {
+        m_renderer.SetParallelUpdate(!m_renderer.GetParallelUpdate());
+    }
+    inline void TogglePipelined()
+    {
+        m_renderer.SetPipelined(!m_renderer.GetPipelined());
+    }
+    inline void ToggleSkinningMode()
+    {
+        // Press K to compare vertex shader skinning against the compute pre-pass, [ and ] change how
+        // many times the scene is drawn.
+        auto mode = (SkinningMode)((m_renderer.GetSkinningMode() + 1) % SkinningMode_Count);
+        m_renderer.SetSkinningMode(mode);
+    }
+    inline void AddPasses(int count)
+    {
+        m_renderer.SetPassCount((uint32_t)std::max((int)m_renderer.GetPassCount() + count, 1));
+    }
+    inline void TogglePaletteKernel()
+    {
+        // Press V to step through the palette kernels this CPU supports, B prints a benchmark of all of them.
+        auto kernel = (PaletteKernel)((m_renderer.GetPaletteKernel() + 1) % (GetSupportedPaletteKernel() + 1));
+        m_renderer.SetPaletteKernel(kernel);
+    }
+    inline void ToggleGpuDriven()
+    {
+        // Press G to cull and build the draws on the GPU, stays off if the device can't draw indirect.
+        m_renderer.SetGpuDriven(!m_renderer.GetGpuDriven());
+    }
+    inline void ToggleMeshLod()
+    {
+        // Press O to always draw the full meshes, and again to go back to a pixel of error.
+        m_renderer.SetMeshLodPixelError(m_renderer.GetMeshLodPixelError() > 0.0f ? 0.0f : 1.0f);
+    }
+    inline void TogglePoseCache()
+    {
+        auto &settings = m_renderer.GetPoseCacheSettings();
+        settings.enabled = !settings.enabled;
+    }
 
   private:
+    bool LoadScene();
+
     Renderer m_renderer;
+    const ModelAsset *m_asset = nullptr;
+    std::vector<uint32_t> m_instances;
     GLFWwindow *m_window = nullptr;
     bool m_running = false;
     Camera m_camera;
@@ -0,0 +1,136 @@
+#include "jobs.h"
+
+#include <assert.h>
+
+static thread_local uint32_t t_threadIndex = 0;
+
+bool JobSystem::Init(uint32_t workerCount)
+{
+    if (workerCount == 0) {
+        uint32_t hardwareThreads = std::thread::hardware_concurrency();
+        workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+    }
+
+    m_running = true;
+    for (uint32_t i = 0; i < workerCount + 1; ++i) {
+        m_queues.push_back(std::make_unique<JobQueue>());
+    }
+    for (uint32_t i = 0; i < workerCount; ++i) {
+        m_workers.emplace_back(&JobSystem::WorkerMain, this, i + 1);
+    }
+    return true;
+}
+
+void JobSystem::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_running = false;
+    }
+    m_wake.notify_all();
+
+    for (auto &worker : m_workers) {
+        worker.join();
+    }
+    m_workers.clear();
+    m_queues.clear();
+}
+
+void JobSystem::ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t)> &function)
+{
+    assert(batchSize > 0);
+    if (count == 0) {
+        return;
+    }
+    if (m_workers.empty() || count <= batchSize) {
+        for (uint32_t i = 0; i < count; ++i) {
+            function(i);
+        }
+        return;
+    }
+
+    const uint32_t jobCount = (count + batchSize - 1) / batchSize;
+    std::atomic<uint32_t> pending = jobCount;
+
+    auto &queue = *m_queues[t_threadIndex];
+    {
+        // Counted before any of them can be popped, so the count never drops below the queued jobs.
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        m_queuedJobs += jobCount;
+        for (uint32_t begin = 0; begin < count; begin += batchSize) {
+            Job job = {};
+            job.function = &function;
+            job.begin = begin;
+            job.end = std::min(begin + batchSize, count);
+            job.pending = &pending;
+            queue.jobs.push_back(job);
+        }
+    }
+
+    // Taking the lock orders the count against a worker checking it before it sleeps.
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_wake.notify_all();
+
+    while (pending.load(std::memory_order_acquire) > 0) {
+        Job job;
+        if (PopJob(t_threadIndex, job)) {
+            RunJob(job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void JobSystem::WorkerMain(uint32_t threadIndex)
+{
+    t_threadIndex = threadIndex;
+
+    while (true) {
+        Job job;
+        if (PopJob(threadIndex, job)) {
+            RunJob(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_wake.wait(lock, [this] { return !m_running || m_queuedJobs > 0; });
+        if (!m_running) {
+            return;
+        }
+    }
+}
+
+bool JobSystem::PopJob(uint32_t threadIndex, Job &outJob)
+{
+    const uint32_t queueCount = (uint32_t)m_queues.size();
+    for (uint32_t i = 0; i < queueCount; ++i) {
+        const uint32_t victim = (threadIndex + i) % queueCount;
+        auto &queue = *m_queues[victim];
+
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) {
+            continue;
+        }
+        // Newest first from our own queue while it is still in cache, oldest first when stealing.
+        if (victim == threadIndex) {
+            outJob = queue.jobs.back();
+            queue.jobs.pop_back();
+        } else {
+            outJob = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        m_queuedJobs--;
+        return true;
+    }
+    return false;
+}
+
+void JobSystem::RunJob(const Job &job)
+{
+    for (uint32_t i = job.begin; i < job.end; ++i) {
+        (*job.function)(i);
+    }
+    job.pending->fetch_sub(1, std::memory_order_release);
+}
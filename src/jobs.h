@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Contiguous range of a ParallelFor, run by whichever thread pops or steals it.
+struct Job
+{
+    const std::function<void(uint32_t)> *function = nullptr;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    std::atomic<uint32_t> *pending = nullptr;
+};
+
+// Owner pushes and pops at the back, other threads steal from the front.
+struct JobQueue
+{
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+// Fixed pool of workers with a deque each. The thread calling ParallelFor runs jobs too
+// while it waits, so a job may itself call ParallelFor.
+class JobSystem
+{
+  public:
+    // 0 picks one worker per hardware thread besides the calling one.
+    bool Init(uint32_t workerCount = 0);
+    void Shutdown();
+    // Calls function(i) for every i below count, batchSize indices per job. Returns once all
+    // of them are done.
+    void ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t)> &function);
+
+    inline uint32_t GetThreadCount() const
+    {
+        return (uint32_t)m_workers.size() + 1;
+    }
+
+  private:
+    void WorkerMain(uint32_t threadIndex);
+    bool PopJob(uint32_t threadIndex, Job &outJob);
+    void RunJob(const Job &job);
+
+    std::vector<std::thread> m_workers;
+    // One per thread, index 0 belongs to the thread that called Init.
+    std::vector<std::unique_ptr<JobQueue>> m_queues;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+    std::atomic<uint32_t> m_queuedJobs = 0;
+    std::atomic<bool> m_running = false;
+};
+
+// Lock free handoff of the newest value between one producer and one consumer thread.
+// The producer fills GetWriteSlot() and calls Publish(), the consumer calls Acquire() and
+// reads GetReadSlot() until it acquires again. Neither side ever waits on the other.
+template <typename T> class TripleBuffer
+{
+  public:
+    inline T &GetWriteSlot()
+    {
+        return m_slots[m_writeIndex];
+    }
+    inline void Publish()
+    {
+        uint32_t previous = m_middle.exchange(m_writeIndex | FreshBit, std::memory_order_acq_rel);
+        m_writeIndex = previous & IndexMask;
+    }
+    // Returns false when nothing new was published since the last call.
+    inline bool Acquire()
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & FreshBit) == 0) {
+            return false;
+        }
+        uint32_t previous = m_middle.exchange(m_readIndex, std::memory_order_acq_rel);
+        m_readIndex = previous & IndexMask;
+        return true;
+    }
+    inline const T &GetReadSlot() const
+    {
+        return m_slots[m_readIndex];
+    }
+
+  private:
+    static constexpr uint32_t FreshBit = 4;
+    static constexpr uint32_t IndexMask = 3;
+
+    T m_slots[3];
+    uint32_t m_writeIndex = 0;
+    std::atomic<uint32_t> m_middle = 1;
+    uint32_t m_readIndex = 2;
+};
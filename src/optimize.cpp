@@ -0,0 +1,185 @@
+#include "optimize.h"
+
+#include <math.h>
+#include <string_view>
+#include <unordered_map>
+
+// Size of the LRU cache the triangle order is scored against, larger than any real one so the order
+// holds up on all of them.
+#define SCORE_CACHE_SIZE 32
+
+// Forsyth's scores: vertices of the last triangle get a flat score so the next one doesn't just reuse
+// the same edge, the rest fall off with age. Vertices with few triangles left get a boost, which
+// finishes off corners instead of leaving single triangles behind.
+static float GetVertexScore(int32_t cachePosition, uint32_t remainingTriangles)
+{
+    if (remainingTriangles == 0) {
+        return -1.0f;
+    }
+
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            score = 0.75f;
+        } else {
+            score = powf(1.0f - (float)(cachePosition - 3) / (float)(SCORE_CACHE_SIZE - 3), 1.5f);
+        }
+    }
+    return score + 2.0f / sqrtf((float)remainingTriangles);
+}
+
+VertexCacheStats AnalyzeVertexCache(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                                    uint32_t cacheSize)
+{
+    VertexCacheStats stats;
+    if (indexCount < 3) {
+        return stats;
+    }
+
+    // A vertex is still in the FIFO if fewer than cacheSize misses happened since it was loaded.
+    std::vector<uint32_t> timestamps(vertexCount, 0);
+    uint32_t time = cacheSize + 1;
+    uint32_t misses = 0;
+    for (size_t i = 0; i < indexCount; ++i) {
+        const uint32_t v = indices[i];
+        if (time - timestamps[v] > cacheSize) {
+            timestamps[v] = time++;
+            misses++;
+        }
+    }
+
+    uint32_t usedCount = 0;
+    for (uint32_t timestamp : timestamps) {
+        usedCount += timestamp != 0;
+    }
+    stats.acmr = (float)misses / (float)(indexCount / 3);
+    stats.atvr = (float)misses / (float)usedCount;
+    return stats;
+}
+
+void OptimizeVertexCache(uint32_t *indices, size_t indexCount, uint32_t vertexCount)
+{
+    const uint32_t triangleCount = (uint32_t)(indexCount / 3);
+    if (triangleCount == 0) {
+        return;
+    }
+
+    // Triangles around every vertex, the ones still to emit at the front of each list.
+    std::vector<uint32_t> triangleOffsets(vertexCount + 1, 0);
+    for (size_t i = 0; i < triangleCount * 3; ++i) {
+        triangleOffsets[indices[i] + 1]++;
+    }
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        triangleOffsets[v + 1] += triangleOffsets[v];
+    }
+    std::vector<uint32_t> vertexTriangles(triangleCount * 3);
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    for (uint32_t i = 0; i < triangleCount * 3; ++i) {
+        const uint32_t v = indices[i];
+        vertexTriangles[triangleOffsets[v] + remaining[v]++] = i / 3;
+    }
+
+    std::vector<float> vertexScores(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        vertexScores[v] = GetVertexScore(-1, remaining[v]);
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(triangleCount * 3);
+    std::vector<uint8_t> emitted(triangleCount, 0);
+    uint32_t cache[SCORE_CACHE_SIZE + 3];
+    uint32_t cacheCount = 0;
+    uint32_t scanCursor = 0;
+    uint32_t nextTriangle = UINT32_MAX;
+    while (result.size() < triangleCount * 3) {
+        // Nothing in the cache has triangles left, carry on in the original order.
+        if (nextTriangle == UINT32_MAX) {
+            while (emitted[scanCursor]) {
+                scanCursor++;
+            }
+            nextTriangle = scanCursor;
+        }
+
+        const uint32_t *triangle = &indices[nextTriangle * 3];
+        result.insert(result.end(), triangle, triangle + 3);
+        emitted[nextTriangle] = 1;
+
+        uint32_t newCache[SCORE_CACHE_SIZE + 3];
+        uint32_t newCount = 0;
+        for (uint32_t k = 0; k < 3; ++k) {
+            const uint32_t v = triangle[k];
+            uint32_t *triangles = &vertexTriangles[triangleOffsets[v]];
+            for (uint32_t i = 0; i < remaining[v]; ++i) {
+                if (triangles[i] == nextTriangle) {
+                    triangles[i] = triangles[--remaining[v]];
+                    break;
+                }
+            }
+            if (k == 0 || (v != triangle[0] && (k == 1 || v != triangle[1]))) {
+                newCache[newCount++] = v;
+            }
+        }
+        for (uint32_t i = 0; i < cacheCount; ++i) {
+            const uint32_t v = cache[i];
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2]) {
+                newCache[newCount++] = v;
+            }
+        }
+
+        // Vertices pushed out of the cache are scored as well, their triangles lose the cache bonus.
+        for (uint32_t i = 0; i < newCount; ++i) {
+            const uint32_t v = newCache[i];
+            vertexScores[v] = GetVertexScore(i < SCORE_CACHE_SIZE ? (int32_t)i : -1, remaining[v]);
+        }
+
+        nextTriangle = UINT32_MAX;
+        float bestScore = -1.0f;
+        for (uint32_t i = 0; i < newCount; ++i) {
+            const uint32_t v = newCache[i];
+            const uint32_t *triangles = &vertexTriangles[triangleOffsets[v]];
+            for (uint32_t j = 0; j < remaining[v]; ++j) {
+                const uint32_t t = triangles[j];
+                const uint32_t *corners = &indices[t * 3];
+                const float score = vertexScores[corners[0]] + vertexScores[corners[1]] + vertexScores[corners[2]];
+                if (i < SCORE_CACHE_SIZE && score > bestScore) {
+                    bestScore = score;
+                    nextTriangle = t;
+                }
+            }
+        }
+
+        cacheCount = newCount < SCORE_CACHE_SIZE ? newCount : SCORE_CACHE_SIZE;
+        for (uint32_t i = 0; i < cacheCount; ++i) {
+            cache[i] = newCache[i];
+        }
+    }
+
+    for (size_t i = 0; i < result.size(); ++i) {
+        indices[i] = result[i];
+    }
+}
+
+uint32_t OptimizeVertexFetch(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                             std::vector<uint32_t> &outRemap)
+{
+    outRemap.assign(vertexCount, UINT32_MAX);
+    uint32_t nextVertex = 0;
+    for (size_t i = 0; i < indexCount; ++i) {
+        if (outRemap[indices[i]] == UINT32_MAX) {
+            outRemap[indices[i]] = nextVertex++;
+        }
+    }
+    return nextVertex;
+}
+
+uint32_t WeldVertices(const void *vertices, size_t vertexSize, uint32_t vertexCount, std::vector<uint32_t> &outRemap)
+{
+    std::unordered_map<std::string_view, uint32_t> uniqueVertices;
+    uniqueVertices.reserve(vertexCount);
+    outRemap.resize(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        const std::string_view bytes((const char *)vertices + v * vertexSize, vertexSize);
+        outRemap[v] = uniqueVertices.emplace(bytes, (uint32_t)uniqueVertices.size()).first->second;
+    }
+    return (uint32_t)uniqueVertices.size();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Entries of the FIFO post-transform cache the statistics are simulated with.
+#define VERTEX_CACHE_SIZE 16
+
+struct VertexCacheStats
+{
+    // Transformed vertices per triangle, 0.5 on a regular grid at best and 3 at worst.
+    float acmr = 0.0f;
+    // Transformed vertices per referenced vertex, 1 at best.
+    float atvr = 0.0f;
+};
+
+VertexCacheStats AnalyzeVertexCache(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                                    uint32_t cacheSize);
+
+// Reorders the triangles of a triangle list so the vertices of each one are still in the post-transform
+// cache from the ones before, whatever the cache's size. Triangles keep their winding.
+void OptimizeVertexCache(uint32_t *indices, size_t indexCount, uint32_t vertexCount);
+
+// Numbers the vertices in the order the indices first use them, so vertex fetches stream through memory.
+// Unused vertices map to UINT32_MAX. Returns how many are used.
+uint32_t OptimizeVertexFetch(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                             std::vector<uint32_t> &outRemap);
+
+// Maps every vertex onto the first one with the same bytes, numbered in order. Returns how many are left.
+uint32_t WeldVertices(const void *vertices, size_t vertexSize, uint32_t vertexCount, std::vector<uint32_t> &outRemap);
@@ -0,0 +1,348 @@
+#include "palette.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define PALETTE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC emits AVX2 and FMA intrinsics without per function targets.
+#define PALETTE_AVX2_TARGET
+#else
+#define PALETTE_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+template <PaletteFormat Format> static inline void PackJoint(const glm::mat4 &matrix, glm::vec4 *out);
+
+template <> inline void PackJoint<PaletteFormat_Mat4>(const glm::mat4 &matrix, glm::vec4 *out)
+{
+    out[0] = matrix[0];
+    out[1] = matrix[1];
+    out[2] = matrix[2];
+    out[3] = matrix[3];
+}
+
+template <> inline void PackJoint<PaletteFormat_Mat3x4>(const glm::mat4 &matrix, glm::vec4 *out)
+{
+    // Rows, the bottom one of an affine matrix is always (0, 0, 0, 1).
+    out[0] = glm::vec4(matrix[0][0], matrix[1][0], matrix[2][0], matrix[3][0]);
+    out[1] = glm::vec4(matrix[0][1], matrix[1][1], matrix[2][1], matrix[3][1]);
+    out[2] = glm::vec4(matrix[0][2], matrix[1][2], matrix[2][2], matrix[3][2]);
+}
+
+template <> inline void PackJoint<PaletteFormat_DualQuat>(const glm::mat4 &matrix, glm::vec4 *out)
+{
+    const glm::mat3 rotation(glm::normalize(glm::vec3(matrix[0])), glm::normalize(glm::vec3(matrix[1])),
+                             glm::normalize(glm::vec3(matrix[2])));
+    const glm::quat real = glm::quat_cast(rotation);
+    const glm::vec3 translation = glm::vec3(matrix[3]);
+    const glm::vec3 axis(real.x, real.y, real.z);
+
+    // dual = 0.5 * (translation, 0) * real
+    out[0] = glm::vec4(axis, real.w);
+    out[1] = glm::vec4(0.5f * (real.w * translation + glm::cross(translation, axis)),
+                       -0.5f * glm::dot(translation, axis));
+}
+
+template <PaletteFormat Format>
+static void BuildPaletteScalar(const glm::mat4 &rootInverse, const glm::mat4 *worldMatrices, const uint32_t *joints,
+                               const glm::mat4 *inverseBindMatrices, uint32_t count, glm::vec4 *out)
+{
+    const uint32_t stride = GetPaletteStride(Format);
+    for (uint32_t i = 0; i < count; ++i) {
+        PackJoint<Format>(rootInverse * (worldMatrices[joints[i]] * inverseBindMatrices[i]), &out[i * stride]);
+    }
+}
+
+#if defined(PALETTE_X86)
+
+//
+// SSE, one joint at a time
+//
+
+template <int Lane> static inline __m128 Splat(__m128 v)
+{
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(Lane, Lane, Lane, Lane));
+}
+
+// a[0] * b.x + a[1] * b.y + a[2] * b.z
+static inline __m128 Combine3(const __m128 *a, __m128 b)
+{
+    __m128 r = _mm_mul_ps(a[0], Splat<0>(b));
+    r = _mm_add_ps(r, _mm_mul_ps(a[1], Splat<1>(b)));
+    return _mm_add_ps(r, _mm_mul_ps(a[2], Splat<2>(b)));
+}
+
+// Column major product of two affine matrices, the w row of both is (0, 0, 0, 1).
+static inline void MulAffine(const __m128 *a, const __m128 *b, __m128 *out)
+{
+    out[0] = Combine3(a, b[0]);
+    out[1] = Combine3(a, b[1]);
+    out[2] = Combine3(a, b[2]);
+    out[3] = _mm_add_ps(Combine3(a, b[3]), a[3]);
+}
+
+static inline void LoadMatrix(const glm::mat4 &matrix, __m128 *out)
+{
+    for (int c = 0; c < 4; ++c) {
+        out[c] = _mm_loadu_ps(&matrix[c][0]);
+    }
+}
+
+template <PaletteFormat Format> static inline void StoreJoint(const __m128 *m, glm::vec4 *out);
+
+template <> inline void StoreJoint<PaletteFormat_Mat4>(const __m128 *m, glm::vec4 *out)
+{
+    for (int c = 0; c < 4; ++c) {
+        _mm_storeu_ps(&out[c].x, m[c]);
+    }
+}
+
+template <> inline void StoreJoint<PaletteFormat_Mat3x4>(const __m128 *m, glm::vec4 *out)
+{
+    __m128 r0 = m[0], r1 = m[1], r2 = m[2], r3 = m[3];
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(&out[0].x, r0);
+    _mm_storeu_ps(&out[1].x, r1);
+    _mm_storeu_ps(&out[2].x, r2);
+}
+
+template <> inline void StoreJoint<PaletteFormat_DualQuat>(const __m128 *m, glm::vec4 *out)
+{
+    // The quaternion extraction branches per joint, only the products are vectorized.
+    glm::mat4 matrix;
+    StoreJoint<PaletteFormat_Mat4>(m, &matrix[0]);
+    PackJoint<PaletteFormat_DualQuat>(matrix, out);
+}
+
+template <PaletteFormat Format>
+static inline void BuildJointSSE(const __m128 *root, const glm::mat4 &world, const glm::mat4 &inverseBind,
+                                 glm::vec4 *out)
+{
+    __m128 w[4], b[4], t[4], m[4];
+    LoadMatrix(world, w);
+    LoadMatrix(inverseBind, b);
+    MulAffine(root, w, t);
+    MulAffine(t, b, m);
+    StoreJoint<Format>(m, out);
+}
+
+template <PaletteFormat Format>
+static void BuildPaletteSSE(const glm::mat4 &rootInverse, const glm::mat4 *worldMatrices, const uint32_t *joints,
+                            const glm::mat4 *inverseBindMatrices, uint32_t count, glm::vec4 *out)
+{
+    const uint32_t stride = GetPaletteStride(Format);
+    __m128 root[4];
+    LoadMatrix(rootInverse, root);
+    for (uint32_t i = 0; i < count; ++i) {
+        BuildJointSSE<Format>(root, worldMatrices[joints[i]], inverseBindMatrices[i], &out[i * stride]);
+    }
+}
+
+//
+// AVX2, two joints per register, one in each 128 bit lane
+//
+
+template <int Lane> PALETTE_AVX2_TARGET static inline __m256 SplatLanes(__m256 v)
+{
+    return _mm256_shuffle_ps(v, v, _MM_SHUFFLE(Lane, Lane, Lane, Lane));
+}
+
+PALETTE_AVX2_TARGET static inline __m256 Combine3x2(const __m256 *a, __m256 b)
+{
+    __m256 r = _mm256_mul_ps(a[0], SplatLanes<0>(b));
+    r = _mm256_fmadd_ps(a[1], SplatLanes<1>(b), r);
+    return _mm256_fmadd_ps(a[2], SplatLanes<2>(b), r);
+}
+
+PALETTE_AVX2_TARGET static inline void MulAffinex2(const __m256 *a, const __m256 *b, __m256 *out)
+{
+    out[0] = Combine3x2(a, b[0]);
+    out[1] = Combine3x2(a, b[1]);
+    out[2] = Combine3x2(a, b[2]);
+    out[3] = _mm256_add_ps(Combine3x2(a, b[3]), a[3]);
+}
+
+PALETTE_AVX2_TARGET static inline void LoadMatrixx2(const glm::mat4 &first, const glm::mat4 &second, __m256 *out)
+{
+    for (int c = 0; c < 4; ++c) {
+        out[c] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&first[c][0])),
+                                      _mm_loadu_ps(&second[c][0]), 1);
+    }
+}
+
+template <PaletteFormat Format>
+PALETTE_AVX2_TARGET static void BuildPaletteAVX2(const glm::mat4 &rootInverse, const glm::mat4 *worldMatrices,
+                                                 const uint32_t *joints, const glm::mat4 *inverseBindMatrices,
+                                                 uint32_t count, glm::vec4 *out)
+{
+    const uint32_t stride = GetPaletteStride(Format);
+    __m128 root[4];
+    __m256 root2[4];
+    for (int c = 0; c < 4; ++c) {
+        root[c] = _mm_loadu_ps(&rootInverse[c][0]);
+        root2[c] = _mm256_broadcast_ps((const __m128 *)&rootInverse[c][0]);
+    }
+
+    uint32_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m256 w[4], b[4], t[4], m[4];
+        LoadMatrixx2(worldMatrices[joints[i]], worldMatrices[joints[i + 1]], w);
+        LoadMatrixx2(inverseBindMatrices[i], inverseBindMatrices[i + 1], b);
+        MulAffinex2(root2, w, t);
+        MulAffinex2(t, b, m);
+
+        __m128 first[4], second[4];
+        for (int c = 0; c < 4; ++c) {
+            first[c] = _mm256_castps256_ps128(m[c]);
+            second[c] = _mm256_extractf128_ps(m[c], 1);
+        }
+        StoreJoint<Format>(first, &out[i * stride]);
+        StoreJoint<Format>(second, &out[(i + 1) * stride]);
+    }
+    if (i < count) {
+        BuildJointSSE<Format>(root, worldMatrices[joints[i]], inverseBindMatrices[i], &out[i * stride]);
+    }
+}
+
+#endif
+
+PaletteKernel GetSupportedPaletteKernel()
+{
+    static const PaletteKernel kernel = [] {
+#if defined(PALETTE_X86) && defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        // The OS has to save the ymm registers too.
+        const bool avx = (info[2] & (1 << 28)) != 0 && (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5)) != 0;
+        return avx && avx2 && fma ? PaletteKernel_AVX2 : PaletteKernel_SSE;
+#elif defined(PALETTE_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return PaletteKernel_AVX2;
+        }
+        return PaletteKernel_SSE;
+#else
+        return PaletteKernel_Scalar;
+#endif
+    }();
+    return kernel;
+}
+
+template <PaletteFormat Format>
+static void BuildPalette(PaletteKernel kernel, const glm::mat4 &rootInverse, const glm::mat4 *worldMatrices,
+                         const uint32_t *joints, const glm::mat4 *inverseBindMatrices, uint32_t count, glm::vec4 *out)
+{
+    switch (kernel) {
+#if defined(PALETTE_X86)
+    case PaletteKernel_AVX2:
+        BuildPaletteAVX2<Format>(rootInverse, worldMatrices, joints, inverseBindMatrices, count, out);
+        return;
+    case PaletteKernel_SSE:
+        BuildPaletteSSE<Format>(rootInverse, worldMatrices, joints, inverseBindMatrices, count, out);
+        return;
+#endif
+    default:
+        BuildPaletteScalar<Format>(rootInverse, worldMatrices, joints, inverseBindMatrices, count, out);
+        return;
+    }
+}
+
+void BuildPalette(PaletteKernel kernel, PaletteFormat format, const glm::mat4 &rootInverse,
+                  const glm::mat4 *worldMatrices, const uint32_t *joints, const glm::mat4 *inverseBindMatrices,
+                  uint32_t count, glm::vec4 *out)
+{
+    // Never run a kernel the CPU can't execute.
+    kernel = std::min(kernel, GetSupportedPaletteKernel());
+    switch (format) {
+    case PaletteFormat_Mat4:
+        BuildPalette<PaletteFormat_Mat4>(kernel, rootInverse, worldMatrices, joints, inverseBindMatrices, count, out);
+        break;
+    case PaletteFormat_Mat3x4:
+        BuildPalette<PaletteFormat_Mat3x4>(kernel, rootInverse, worldMatrices, joints, inverseBindMatrices, count,
+                                           out);
+        break;
+    case PaletteFormat_DualQuat:
+        BuildPalette<PaletteFormat_DualQuat>(kernel, rootInverse, worldMatrices, joints, inverseBindMatrices, count,
+                                             out);
+        break;
+    default:
+        break;
+    }
+}
+
+static glm::mat4 RandomRigidMatrix(std::mt19937 &random)
+{
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    glm::quat rotation = glm::normalize(
+        glm::quat(distribution(random), distribution(random), distribution(random), distribution(random)));
+    glm::mat4 matrix = glm::mat4_cast(rotation);
+    matrix[3] = glm::vec4(distribution(random), distribution(random), distribution(random), 1.0f);
+    return matrix;
+}
+
+void BenchmarkPaletteKernels()
+{
+    const uint32_t jointCounts[] = {50, 150, 500};
+    const PaletteFormat format = PaletteFormat_Mat3x4;
+    const uint32_t stride = GetPaletteStride(format);
+    std::mt19937 random(1);
+
+    printf("Palette kernels, %s, joints per us:\n", GetPaletteFormatName(format));
+    for (uint32_t jointCount : jointCounts) {
+        // Joints index a node array twice as large, like a rig with helper nodes.
+        std::vector<glm::mat4> worldMatrices(jointCount * 2);
+        std::vector<glm::mat4> inverseBindMatrices(jointCount);
+        std::vector<uint32_t> joints(jointCount);
+        for (auto &matrix : worldMatrices) {
+            matrix = RandomRigidMatrix(random);
+        }
+        for (uint32_t i = 0; i < jointCount; ++i) {
+            inverseBindMatrices[i] = RandomRigidMatrix(random);
+            joints[i] = i * 2;
+        }
+        const glm::mat4 rootInverse = RandomRigidMatrix(random);
+
+        std::vector<glm::vec4> reference(jointCount * stride);
+        BuildPalette(PaletteKernel_Scalar, format, rootInverse, worldMatrices.data(), joints.data(),
+                     inverseBindMatrices.data(), jointCount, reference.data());
+
+        printf("  %4u joints:", jointCount);
+        std::vector<glm::vec4> out(jointCount * stride);
+        for (uint32_t k = 0; k <= GetSupportedPaletteKernel(); ++k) {
+            const PaletteKernel kernel = (PaletteKernel)k;
+            using Clock = std::chrono::steady_clock;
+            const auto start = Clock::now();
+            double seconds = 0.0;
+            uint64_t iterations = 0;
+            // At least 20 ms per kernel so timer resolution doesn't matter.
+            while (seconds < 0.02) {
+                for (uint32_t r = 0; r < 64; ++r) {
+                    BuildPalette(kernel, format, rootInverse, worldMatrices.data(), joints.data(),
+                                 inverseBindMatrices.data(), jointCount, out.data());
+                }
+                iterations += 64;
+                seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            }
+
+            float maxError = 0.0f;
+            for (uint32_t i = 0; i < out.size(); ++i) {
+                maxError = std::max(maxError, glm::length(out[i] - reference[i]));
+            }
+            printf(" %s %.1f (err %.1e)", GetPaletteKernelName(kernel),
+                   (double)iterations * jointCount / (seconds * 1e6), maxError);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <stdint.h>
+
+enum PaletteFormat
+{
+    // Full matrices, 64 bytes per joint.
+    PaletteFormat_Mat4,
+    // The three rows of an affine matrix, 48 bytes per joint.
+    PaletteFormat_Mat3x4,
+    // Rotation and translation as a dual quaternion, 32 bytes per joint. Only used for skins that
+    // never scale, others fall back to mat3x4.
+    PaletteFormat_DualQuat,
+    PaletteFormat_Count,
+};
+
+// Number of vec4s a joint takes up in the palette.
+inline uint32_t GetPaletteStride(PaletteFormat format)
+{
+    switch (format) {
+    case PaletteFormat_Mat4:
+        return 4;
+    case PaletteFormat_Mat3x4:
+        return 3;
+    case PaletteFormat_DualQuat:
+        return 2;
+    default:
+        break;
+    }
+    return 0;
+}
+
+inline const char *GetPaletteFormatName(PaletteFormat format)
+{
+    switch (format) {
+    case PaletteFormat_Mat4:
+        return "mat4";
+    case PaletteFormat_Mat3x4:
+        return "mat3x4";
+    case PaletteFormat_DualQuat:
+        return "dual quat";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+enum PaletteKernel
+{
+    PaletteKernel_Scalar,
+    PaletteKernel_SSE,
+    // Two joints per iteration, picked at runtime on CPUs with AVX2 and FMA.
+    PaletteKernel_AVX2,
+    PaletteKernel_Count,
+};
+
+inline const char *GetPaletteKernelName(PaletteKernel kernel)
+{
+    switch (kernel) {
+    case PaletteKernel_Scalar:
+        return "scalar";
+    case PaletteKernel_SSE:
+        return "sse";
+    case PaletteKernel_AVX2:
+        return "avx2";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+// The fastest kernel this CPU runs, detected once.
+PaletteKernel GetSupportedPaletteKernel();
+
+// out[i] = rootInverse * worldMatrices[joints[i]] * inverseBindMatrices[i], packed as `format`. All matrices
+// are treated as affine.
+void BuildPalette(PaletteKernel kernel, PaletteFormat format, const glm::mat4 &rootInverse,
+                  const glm::mat4 *worldMatrices, const uint32_t *joints, const glm::mat4 *inverseBindMatrices,
+                  uint32_t count, glm::vec4 *out);
+
+// Prints joints per microsecond of every supported kernel for a few rig sizes.
+void BenchmarkPaletteKernels();
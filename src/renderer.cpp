@@ -1,6 +1,8 @@
 #include "renderer.h"
 #define CGLTF_IMPLEMENTATION
 #include "cgltf.h"
+#include "optimize.h"
+#include "simplify.h"
 
 bool Renderer::CreateInstance()
 {
@@ -46,6 +48,7 @@ bool Renderer::ChoosePhysicalDevice()
 
         uint32_t graphicsFamilyIndex = UINT32_MAX;
         uint32_t presentFamilyIndex = UINT32_MAX;
+        uint32_t transferFamilyIndex = UINT32_MAX;
         for (uint32_t queueFamilyIndex = 0; queueFamilyIndex < queueFamilyCount; ++queueFamilyIndex) {
             VkBool32 presentSupport;
             vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, queueFamilyIndex, m_surface, &presentSupport);
@@ -53,20 +56,27 @@ bool Renderer::ChoosePhysicalDevice()
                 presentFamilyIndex = queueFamilyIndex;
             }
 
-            if (queueFamilyProperties[queueFamilyIndex].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            const VkQueueFlags queueFlags = queueFamilyProperties[queueFamilyIndex].queueFlags;
+            if (queueFlags & VK_QUEUE_GRAPHICS_BIT) {
                 graphicsFamilyIndex = queueFamilyIndex;
             }
+            // Dedicated transfer families usually sit on the copy engines of discrete GPUs.
+            const VkQueueFlags otherFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+            if ((queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFlags & otherFlags)) {
+                transferFamilyIndex = queueFamilyIndex;
+            }
         }
 
         if (graphicsFamilyIndex != UINT32_MAX && presentFamilyIndex != UINT32_MAX) {
 
             m_graphicsFamilyIndex = graphicsFamilyIndex;
             m_presentFamilyIndex = presentFamilyIndex;
+            m_transferFamilyIndex = transferFamilyIndex != UINT32_MAX ? transferFamilyIndex : graphicsFamilyIndex;
             m_physicalDevice = physicalDevice;
-            vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &m_memoryProperties);
 
             VkPhysicalDeviceProperties properties = {};
             vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            m_timestampPeriod = properties.limits.timestampPeriod;
             if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
                 // If found a integrated gpu that is supported, keep it unless there is a discrete one
                 // found later.
@@ -86,9 +96,15 @@ bool Renderer::ChoosePhysicalDevice()
 bool Renderer::CreateDevice()
 {
     const float queuePriority = 1.0f;
-    const uint32_t uniqueFamilyIndexCount = m_graphicsFamilyIndex == m_presentFamilyIndex ? 1 : 2;
-    const uint32_t uniqueFamilyIndices[] = {m_graphicsFamilyIndex, m_presentFamilyIndex};
-    VkDeviceQueueCreateInfo queueInfos[2] = {};
+    uint32_t uniqueFamilyIndexCount = 0;
+    uint32_t uniqueFamilyIndices[3] = {};
+    for (uint32_t familyIndex : {m_graphicsFamilyIndex, m_presentFamilyIndex, m_transferFamilyIndex}) {
+        if (std::find(uniqueFamilyIndices, uniqueFamilyIndices + uniqueFamilyIndexCount, familyIndex) ==
+            uniqueFamilyIndices + uniqueFamilyIndexCount) {
+            uniqueFamilyIndices[uniqueFamilyIndexCount++] = familyIndex;
+        }
+    }
+    VkDeviceQueueCreateInfo queueInfos[3] = {};
     for (uint32_t i = 0; i < uniqueFamilyIndexCount; ++i) {
         queueInfos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
         queueInfos[i].queueFamilyIndex = uniqueFamilyIndices[i];
@@ -105,7 +121,33 @@ bool Renderer::CreateDevice()
     sync2.pNext = &dynamicRendering;
     sync2.synchronization2 = VK_TRUE;
 
+    // Optional, the GPU driven path needs a first instance in indirect draws and uses multi draw and
+    // indirect count when they are there. Software implementations like lavapipe have all three.
+    VkPhysicalDeviceProperties properties = {};
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+
+    VkPhysicalDeviceVulkan12Features supported12 = {};
+    supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+    VkPhysicalDeviceFeatures2 supported = {};
+    supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported.pNext = properties.apiVersion >= VK_API_VERSION_1_2 ? &supported12 : nullptr;
+    vkGetPhysicalDeviceFeatures2(m_physicalDevice, &supported);
+
+    m_drawIndirectFirstInstance = supported.features.drawIndirectFirstInstance;
+    m_multiDrawIndirect = supported.features.multiDrawIndirect;
+    m_drawIndirectCount = supported12.drawIndirectCount;
+
+    VkPhysicalDeviceVulkan12Features enabled12 = {};
+    enabled12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    enabled12.drawIndirectCount = VK_TRUE;
+    if (m_drawIndirectCount) {
+        dynamicRendering.pNext = &enabled12;
+    }
+
     VkPhysicalDeviceFeatures enabledFeatures = {};
+    enabledFeatures.drawIndirectFirstInstance = m_drawIndirectFirstInstance;
+    enabledFeatures.multiDrawIndirect = m_multiDrawIndirect;
 
     VkDeviceCreateInfo deviceCI = {};
     deviceCI.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -120,9 +162,11 @@ bool Renderer::CreateDevice()
     VK_CHECK(vkCreateDevice(m_physicalDevice, &deviceCI, nullptr, &m_device));
 
     volkLoadDevice(m_device);
+    m_allocator.Init(m_physicalDevice, m_device);
 
     vkGetDeviceQueue(m_device, m_graphicsFamilyIndex, 0, &m_graphicsQueue);
     vkGetDeviceQueue(m_device, m_presentFamilyIndex, 0, &m_presentQueue);
+    vkGetDeviceQueue(m_device, m_transferFamilyIndex, 0, &m_transferQueue);
 
     return true;
 }
@@ -195,11 +239,16 @@ bool Renderer::CreateDescriptorSetLayouts()
     descriptorPoolCI.pPoolSizes = poolSizes;
     VK_CHECK(vkCreateDescriptorPool(m_device, &descriptorPoolCI, nullptr, &m_descriptorPool));
 
-    { // Global descriptors
+    { // Global descriptors, the frame's uniforms, instance data, compute skinned vertices and the visible
+      // instances written by the culling pass.
 
         const VkDescriptorSetLayoutBinding bindings[] = {
             // binding; descriptorType; descriptorCount; stageFlags; pImmutableSamplers;
             {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr},
+            {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr},
+            {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+             nullptr},
         };
 
         VkDescriptorSetLayoutCreateInfo layoutCI = {};
@@ -209,22 +258,58 @@ bool Renderer::CreateDescriptorSetLayouts()
         VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutCI, nullptr, &m_globalDescriptorsLayout));
     }
 
-    { // Joints descriptors
+    { // Palette descriptors
+        const VkDescriptorSetLayoutBinding bindings[] = {
+            // binding; descriptorType; descriptorCount; stageFlags; pImmutableSamplers;
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+             nullptr},
+        };
+
+        VkDescriptorSetLayoutCreateInfo layoutCI = {};
+        layoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutCI.bindingCount = ARRAY_COUNT(bindings);
+        layoutCI.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutCI, nullptr, &m_paletteDescriptorsLayout));
+    }
+
+    { // Skinning descriptors, a model's source vertices and the skinned output.
+        const VkDescriptorSetLayoutBinding bindings[] = {
+            // binding; descriptorType; descriptorCount; stageFlags; pImmutableSamplers;
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        };
+
+        VkDescriptorSetLayoutCreateInfo layoutCI = {};
+        layoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutCI.bindingCount = ARRAY_COUNT(bindings);
+        layoutCI.pBindings = bindings;
+        VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutCI, nullptr, &m_skinningDescriptorsLayout));
+    }
+
+    { // Culling descriptors, instance bounds, batches and draw records in, counts and indirect commands out.
         const VkDescriptorSetLayoutBinding bindings[] = {
             // binding; descriptorType; descriptorCount; stageFlags; pImmutableSamplers;
-            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, nullptr},
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+            {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+            {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+            {4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
         };
 
         VkDescriptorSetLayoutCreateInfo layoutCI = {};
         layoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         layoutCI.bindingCount = ARRAY_COUNT(bindings);
         layoutCI.pBindings = bindings;
-        VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutCI, nullptr, &m_jointsDescriptorsLayout));
+        VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutCI, nullptr, &m_cullDescriptorsLayout));
     }
 
     return true;
 }
 
+// Written by the culling pass, read by indirect draws and cleared with vkCmdFillBuffer every frame.
+static const VkBufferUsageFlags indirectUsage =
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
 bool Renderer::CreateFrameData()
 {
     VkCommandPoolCreateInfo commandPoolCI = {};
@@ -233,6 +318,10 @@ bool Renderer::CreateFrameData()
     commandPoolCI.queueFamilyIndex = m_graphicsFamilyIndex;
     VK_CHECK(vkCreateCommandPool(m_device, &commandPoolCI, nullptr, &m_commandPool));
 
+    commandPoolCI.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    commandPoolCI.queueFamilyIndex = m_transferFamilyIndex;
+    VK_CHECK(vkCreateCommandPool(m_device, &commandPoolCI, nullptr, &m_transferCommandPool));
+
     {
         VkCommandBufferAllocateInfo allocateInfo = {};
         allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -291,26 +380,102 @@ bool Renderer::CreateFrameData()
         vkUpdateDescriptorSets(m_device, MAX_FRAMES_IN_FLIGHT, bufferWrites, 0, nullptr);
     }
 
+    {
+        VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT] = {};
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            layouts[i] = m_paletteDescriptorsLayout;
+        }
+
+        VkDescriptorSetAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocateInfo.descriptorPool = m_descriptorPool;
+        allocateInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+        allocateInfo.pSetLayouts = &layouts[0];
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocateInfo, &m_paletteDescriptors[0]));
+
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            if (!ReserveRing(m_paletteRings[i], m_paletteDescriptors[i], 0, 64 * 1024) ||
+                !ReserveRing(m_instanceRings[i], m_globalDescriptors[i], 1, 64 * 1024)) {
+                return false;
+            }
+        }
+    }
+
+    {
+        VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT] = {};
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            layouts[i] = m_cullDescriptorsLayout;
+        }
+
+        VkDescriptorSetAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocateInfo.descriptorPool = m_descriptorPool;
+        allocateInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+        allocateInfo.pSetLayouts = &layouts[0];
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocateInfo, &m_cullDescriptors[0]));
+
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            if (!ReserveRing(m_visibleInstanceRings[i], m_globalDescriptors[i], 3, 16 * 1024) ||
+                !ReserveRing(m_cullInstanceRings[i], m_cullDescriptors[i], 0, 4 * 1024) ||
+                !ReserveRing(m_cullBatchRings[i], m_cullDescriptors[i], 1, 1024) ||
+                !ReserveRing(m_drawRecordRings[i], m_cullDescriptors[i], 2, 4 * 1024) ||
+                !ReserveRing(m_drawCountRings[i], m_cullDescriptors[i], 3, 1024, indirectUsage,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ||
+                !ReserveRing(m_drawCommandRings[i], m_cullDescriptors[i], 4, 4 * 1024, indirectUsage,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+                return false;
+            }
+        }
+    }
+
     return true;
 }
 
 bool Renderer::CreatePipelineLayouts()
 {
-    VkPushConstantRange range = {};
-    range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    range.offset = 0;
-    range.size = sizeof(Constants);
-
-    const VkDescriptorSetLayout layouts[] = {m_globalDescriptorsLayout, m_jointsDescriptorsLayout};
+    // Everything per draw comes from the instance data, there are no push constants.
+    const VkDescriptorSetLayout layouts[] = {m_globalDescriptorsLayout, m_paletteDescriptorsLayout};
 
     VkPipelineLayoutCreateInfo pipelineLayoutCI = {};
     pipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutCI.setLayoutCount = ARRAY_COUNT(layouts);
     pipelineLayoutCI.pSetLayouts = layouts;
-    pipelineLayoutCI.pushConstantRangeCount = 1;
-    pipelineLayoutCI.pPushConstantRanges = &range;
     VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutCI, nullptr, &m_pipelineLayout));
 
+    { // Skinning
+        VkPushConstantRange skinningRange = {};
+        skinningRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        skinningRange.offset = 0;
+        skinningRange.size = sizeof(SkinningConstants);
+
+        const VkDescriptorSetLayout skinningLayouts[] = {m_skinningDescriptorsLayout, m_paletteDescriptorsLayout};
+
+        VkPipelineLayoutCreateInfo skinningLayoutCI = {};
+        skinningLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        skinningLayoutCI.setLayoutCount = ARRAY_COUNT(skinningLayouts);
+        skinningLayoutCI.pSetLayouts = skinningLayouts;
+        skinningLayoutCI.pushConstantRangeCount = 1;
+        skinningLayoutCI.pPushConstantRanges = &skinningRange;
+        VK_CHECK(vkCreatePipelineLayout(m_device, &skinningLayoutCI, nullptr, &m_skinningPipelineLayout));
+    }
+
+    { // Culling
+        VkPushConstantRange cullRange = {};
+        cullRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        cullRange.offset = 0;
+        cullRange.size = sizeof(CullConstants);
+
+        const VkDescriptorSetLayout cullLayouts[] = {m_globalDescriptorsLayout, m_cullDescriptorsLayout};
+
+        VkPipelineLayoutCreateInfo cullLayoutCI = {};
+        cullLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        cullLayoutCI.setLayoutCount = ARRAY_COUNT(cullLayouts);
+        cullLayoutCI.pSetLayouts = cullLayouts;
+        cullLayoutCI.pushConstantRangeCount = 1;
+        cullLayoutCI.pPushConstantRanges = &cullRange;
+        VK_CHECK(vkCreatePipelineLayout(m_device, &cullLayoutCI, nullptr, &m_cullPipelineLayout));
+    }
+
     return true;
 }
 
@@ -371,20 +536,23 @@ bool Renderer::CreateGraphicsPipelines()
     fragmentStage.module = fragmentShader;
     fragmentStage.pName = "main";
 
-    const VkPipelineShaderStageCreateInfo shaderStages[] = {vertexStage, fragmentStage};
+    VkPipelineShaderStageCreateInfo shaderStages[] = {vertexStage, fragmentStage};
+
+    // constantID; offset; size;
+    const VkSpecializationMapEntry paletteFormatEntry = {0, 0, sizeof(uint32_t)};
 
     const VkVertexInputBindingDescription bindings[] = {
         // binding; stride; inputRate;
-        {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+        {0, sizeof(PackedVertex), VK_VERTEX_INPUT_RATE_VERTEX},
     };
 
     const VkVertexInputAttributeDescription attributes[] = {
         // location; binding; format; offset;
-        {0, 0, VK_FORMAT_R32G32B32_SFLOAT, (uint32_t)offsetof(Vertex, position)},
-        {1, 0, VK_FORMAT_R32G32B32_SFLOAT, (uint32_t)offsetof(Vertex, normal)},
-        {2, 0, VK_FORMAT_R32G32_SFLOAT, (uint32_t)offsetof(Vertex, texCoord)},
-        {3, 0, VK_FORMAT_R32G32B32A32_SINT, (uint32_t)offsetof(Vertex, joints)},
-        {4, 0, VK_FORMAT_R32G32B32A32_SFLOAT, (uint32_t)offsetof(Vertex, weights)},
+        {0, 0, VK_FORMAT_R16G16B16A16_UNORM, (uint32_t)offsetof(PackedVertex, position)},
+        {1, 0, VK_FORMAT_R16G16_SNORM, (uint32_t)offsetof(PackedVertex, normal)},
+        {2, 0, VK_FORMAT_R16G16_SFLOAT, (uint32_t)offsetof(PackedVertex, texCoord)},
+        {3, 0, VK_FORMAT_R8G8B8A8_UINT, (uint32_t)offsetof(PackedVertex, joints)},
+        {4, 0, VK_FORMAT_R8G8B8A8_UNORM, (uint32_t)offsetof(PackedVertex, weights)},
     };
 
     VkPipelineVertexInputStateCreateInfo vertexInputCI = {};
@@ -485,7 +653,37 @@ bool Renderer::CreateGraphicsPipelines()
     pipelineCI.pDynamicState = &dynamicCI;
     pipelineCI.layout = m_pipelineLayout;
     pipelineCI.renderPass = nullptr;
-    VK_CHECK(vkCreateGraphicsPipelines(m_device, nullptr, 1, &pipelineCI, nullptr, &m_pipeline));
+    for (uint32_t format = 0; format < PaletteFormat_Count; ++format) {
+        VkSpecializationInfo specializationInfo = {};
+        specializationInfo.mapEntryCount = 1;
+        specializationInfo.pMapEntries = &paletteFormatEntry;
+        specializationInfo.dataSize = sizeof(format);
+        specializationInfo.pData = &format;
+        shaderStages[0].pSpecializationInfo = &specializationInfo;
+        VK_CHECK(vkCreateGraphicsPipelines(m_device, nullptr, 1, &pipelineCI, nullptr, &m_pipelines[format]));
+    }
+
+    { // Static, draws the output of the compute skinning pass.
+        // Vertices are fetched from the instance's range of the skinned vertex buffer, there is no vertex input.
+        VkShaderModule staticShader = nullptr;
+        if (!ReadFileBytes("./shaders/static.vert.spv", bytes) ||
+            !CompileShader(&bytes[0], bytes.size(), staticShader)) {
+            return false;
+        }
+
+        VkPipelineShaderStageCreateInfo staticStages[] = {vertexStage, fragmentStage};
+        staticStages[0].module = staticShader;
+
+        VkPipelineVertexInputStateCreateInfo staticVertexInputCI = {};
+        staticVertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+        pipelineCI.stageCount = ARRAY_COUNT(staticStages);
+        pipelineCI.pStages = staticStages;
+        pipelineCI.pVertexInputState = &staticVertexInputCI;
+        VK_CHECK(vkCreateGraphicsPipelines(m_device, nullptr, 1, &pipelineCI, nullptr, &m_staticPipeline));
+
+        vkDestroyShaderModule(m_device, staticShader, nullptr);
+    }
 
     vkDestroyShaderModule(m_device, vertexShader, nullptr);
     vkDestroyShaderModule(m_device, fragmentShader, nullptr);
@@ -493,35 +691,78 @@ bool Renderer::CreateGraphicsPipelines()
     return true;
 }
 
-bool Renderer::AllocateDeviceMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags propertyFlags,
-                                    VkDeviceMemory &outMemory)
+bool Renderer::CreateComputePipelines()
 {
-    outMemory = nullptr;
-    for (uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; ++i) {
-        uint32_t memoryTypeBits = (1 << i);
-        if ((requirements.memoryTypeBits & memoryTypeBits) == memoryTypeBits) {
-            if ((m_memoryProperties.memoryTypes[i].propertyFlags & propertyFlags) == propertyFlags) {
-                VkMemoryAllocateInfo allocateInfo = {};
-                allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-                allocateInfo.allocationSize = requirements.size;
-                allocateInfo.memoryTypeIndex = i;
-                VK_CHECK(vkAllocateMemory(m_device, &allocateInfo, nullptr, &outMemory));
-                break;
-            }
-        }
-    }
-    if (outMemory == nullptr) {
+    VkShaderModule skinningShader = nullptr;
+    std::vector<uint8_t> bytes;
+
+    if (!ReadFileBytes("./shaders/skinning.comp.spv", bytes) ||
+        !CompileShader(&bytes[0], bytes.size(), skinningShader)) {
         return false;
     }
 
+    // constantID; offset; size;
+    const VkSpecializationMapEntry paletteFormatEntry = {0, 0, sizeof(uint32_t)};
+
+    for (uint32_t format = 0; format < PaletteFormat_Count; ++format) {
+        VkSpecializationInfo specializationInfo = {};
+        specializationInfo.mapEntryCount = 1;
+        specializationInfo.pMapEntries = &paletteFormatEntry;
+        specializationInfo.dataSize = sizeof(format);
+        specializationInfo.pData = &format;
+
+        VkComputePipelineCreateInfo pipelineCI = {};
+        pipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineCI.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineCI.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineCI.stage.module = skinningShader;
+        pipelineCI.stage.pName = "main";
+        pipelineCI.stage.pSpecializationInfo = &specializationInfo;
+        pipelineCI.layout = m_skinningPipelineLayout;
+        VK_CHECK(vkCreateComputePipelines(m_device, nullptr, 1, &pipelineCI, nullptr, &m_skinningPipelines[format]));
+    }
+
+    vkDestroyShaderModule(m_device, skinningShader, nullptr);
+
+    const char *cullShaderPaths[] = {"./shaders/cull.comp.spv", "./shaders/draw_commands.comp.spv"};
+    VkPipeline *cullPipelines[] = {&m_cullPipeline, &m_drawCommandPipeline};
+    for (uint32_t i = 0; i < ARRAY_COUNT(cullShaderPaths); ++i) {
+        VkShaderModule cullShader = nullptr;
+        if (!ReadFileBytes(cullShaderPaths[i], bytes) || !CompileShader(&bytes[0], bytes.size(), cullShader)) {
+            return false;
+        }
+
+        VkComputePipelineCreateInfo pipelineCI = {};
+        pipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineCI.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineCI.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineCI.stage.module = cullShader;
+        pipelineCI.stage.pName = "main";
+        pipelineCI.layout = m_cullPipelineLayout;
+        VK_CHECK(vkCreateComputePipelines(m_device, nullptr, 1, &pipelineCI, nullptr, cullPipelines[i]));
+
+        vkDestroyShaderModule(m_device, cullShader, nullptr);
+    }
+
+    return true;
+}
+
+bool Renderer::CreateQueryPool()
+{
+    VkQueryPoolCreateInfo queryPoolCI = {};
+    queryPoolCI.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCI.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCI.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+    VK_CHECK(vkCreateQueryPool(m_device, &queryPoolCI, nullptr, &m_queryPool));
+
     return true;
 }
 
 void Renderer::DestroyDepthBuffer()
 {
     vkDestroyImageView(m_device, m_depthBufferImageView, nullptr);
-    vkFreeMemory(m_device, m_depthBufferMemory, nullptr);
     vkDestroyImage(m_device, m_depthBufferImage, nullptr);
+    m_allocator.Free(m_depthBufferAllocation);
 }
 
 bool Renderer::CreateDepthBuffer()
@@ -543,9 +784,12 @@ bool Renderer::CreateDepthBuffer()
 
     VkMemoryRequirements requirements = {};
     vkGetImageMemoryRequirements(m_device, m_depthBufferImage, &requirements);
-    VkMemoryPropertyFlags propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-    AllocateDeviceMemory(requirements, propertyFlags, m_depthBufferMemory);
-    VK_CHECK(vkBindImageMemory(m_device, m_depthBufferImage, m_depthBufferMemory, 0));
+    if (!m_allocator.Allocate(requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, m_depthBufferAllocation)) {
+        LOG_ERROR("Couldn't allocate the depth buffer.");
+        return false;
+    }
+    VK_CHECK(vkBindImageMemory(m_device, m_depthBufferImage, m_depthBufferAllocation.memory,
+                               m_depthBufferAllocation.offset));
 
     VkImageViewCreateInfo imageViewCI = {};
     imageViewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -562,7 +806,8 @@ bool Renderer::CreateDepthBuffer()
     return true;
 }
 
-bool Renderer::CreateBuffer(VkBufferUsageFlags usage, VkDeviceSize size, AllocatedBuffer &outBuffer)
+bool Renderer::CreateBuffer(VkBufferUsageFlags usage, VkDeviceSize size, AllocatedBuffer &outBuffer,
+                            VkMemoryPropertyFlags propertyFlags)
 {
     VkBufferCreateInfo bufferCI = {};
     bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -572,13 +817,264 @@ bool Renderer::CreateBuffer(VkBufferUsageFlags usage, VkDeviceSize size, Allocat
 
     VkMemoryRequirements requirements = {};
     vkGetBufferMemoryRequirements(m_device, outBuffer.buffer, &requirements);
-    VkMemoryPropertyFlags propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    AllocateDeviceMemory(requirements, propertyFlags, outBuffer.memory);
+    if (!m_allocator.Allocate(requirements, propertyFlags, true, outBuffer.allocation)) {
+        LOG_ERROR("Couldn't allocate %llu bytes for a buffer.", (unsigned long long)size);
+        vkDestroyBuffer(m_device, outBuffer.buffer, nullptr);
+        outBuffer = {};
+        return false;
+    }
 
-    VK_CHECK(vkBindBufferMemory(m_device, outBuffer.buffer, outBuffer.memory, 0));
+    VK_CHECK(vkBindBufferMemory(m_device, outBuffer.buffer, outBuffer.allocation.memory, outBuffer.allocation.offset));
     outBuffer.size = size;
-    VK_CHECK(vkMapMemory(m_device, outBuffer.memory, 0, outBuffer.size, 0, &outBuffer.data));
+    outBuffer.data = outBuffer.allocation.data;
+
+    return true;
+}
+
+void Renderer::DestroyBuffer(AllocatedBuffer &buffer)
+{
+    vkDestroyBuffer(m_device, buffer.buffer, nullptr);
+    m_allocator.Free(buffer.allocation);
+    buffer = {};
+}
+
+bool Renderer::UploadBuffer(VkBufferUsageFlags usage, const void *data, VkDeviceSize size, AllocatedBuffer &outBuffer)
+{
+    AllocatedBuffer staging = {};
+    if (!CreateBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, staging)) {
+        return false;
+    }
+    memcpy(staging.data, data, size);
+    if (!CreateBuffer(usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, size, outBuffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+        DestroyBuffer(staging);
+        return false;
+    }
+
+    auto &upload = m_openUpload;
+    if (!upload.commandBuffer) {
+        VkCommandBufferAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocateInfo.commandPool = m_transferCommandPool;
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &allocateInfo, &upload.commandBuffer));
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VK_CHECK(vkBeginCommandBuffer(upload.commandBuffer, &beginInfo));
+    }
+
+    VkBufferCopy region = {};
+    region.size = size;
+    vkCmdCopyBuffer(upload.commandBuffer, staging.buffer, outBuffer.buffer, 1, &region);
+    upload.stagingBuffers.push_back(staging);
+
+    // Coming from another family the transfer queue has to release the buffer and the graphics queue
+    // acquire it with a matching barrier. Otherwise the semaphore orders the copy and the acquire
+    // barrier only makes the writes visible.
+    const bool ownershipTransfer = m_transferFamilyIndex != m_graphicsFamilyIndex;
+    VkBufferMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.srcQueueFamilyIndex = ownershipTransfer ? m_transferFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = ownershipTransfer ? m_graphicsFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = outBuffer.buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    if (ownershipTransfer) {
+        VkDependencyInfo dependencyInfo = {};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependencyInfo.bufferMemoryBarrierCount = 1;
+        dependencyInfo.pBufferMemoryBarriers = &barrier;
+        vkCmdPipelineBarrier2KHR(upload.commandBuffer, &dependencyInfo);
+
+        barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+        barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    }
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT |
+                           VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_2_INDEX_READ_BIT |
+                            VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+    upload.acquireBarriers.push_back(barrier);
+    return true;
+}
+
+bool Renderer::SubmitUploads()
+{
+    auto &upload = m_openUpload;
+    if (!upload.commandBuffer) {
+        return true;
+    }
+    VK_CHECK(vkEndCommandBuffer(upload.commandBuffer));
+
+    VkFenceCreateInfo fenceCI = {};
+    fenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(m_device, &fenceCI, nullptr, &upload.fence));
+
+    VkSemaphoreCreateInfo semaphoreCI = {};
+    semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreCI, nullptr, &upload.semaphore));
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &upload.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &upload.semaphore;
+    VK_CHECK(vkQueueSubmit(m_transferQueue, 1, &submitInfo, upload.fence));
+
+    m_pendingUploads.push_back(std::move(upload));
+    upload = {};
+    return true;
+}
+
+// Records the acquire barriers of everything submitted since the last frame and queues up their
+// semaphores for this frame's submit.
+void Renderer::AcquireUploads(VkCommandBuffer commandBuffer)
+{
+    for (auto &upload : m_pendingUploads) {
+        if (upload.acquireFrame != UINT64_MAX) {
+            continue;
+        }
+
+        VkDependencyInfo dependencyInfo = {};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependencyInfo.bufferMemoryBarrierCount = (uint32_t)upload.acquireBarriers.size();
+        dependencyInfo.pBufferMemoryBarriers = upload.acquireBarriers.data();
+        vkCmdPipelineBarrier2KHR(commandBuffer, &dependencyInfo);
+
+        m_waitSemaphores.push_back(upload.semaphore);
+        m_waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        upload.acquireFrame = m_frameCount;
+    }
+}
+
+// Staging buffers go once the copy is done and the frame that waited on the semaphore is too, which
+// is certain after a full round of frames in flight. Never blocks.
+void Renderer::RetireUploads()
+{
+    for (size_t i = 0; i < m_pendingUploads.size();) {
+        auto &upload = m_pendingUploads[i];
+        if (upload.acquireFrame == UINT64_MAX || upload.acquireFrame + MAX_FRAMES_IN_FLIGHT > m_frameCount ||
+            vkGetFenceStatus(m_device, upload.fence) != VK_SUCCESS) {
+            ++i;
+            continue;
+        }
+
+        for (auto &staging : upload.stagingBuffers) {
+            DestroyBuffer(staging);
+        }
+        vkFreeCommandBuffers(m_device, m_transferCommandPool, 1, &upload.commandBuffer);
+        vkDestroyFence(m_device, upload.fence, nullptr);
+        vkDestroySemaphore(m_device, upload.semaphore, nullptr);
+        m_pendingUploads.erase(m_pendingUploads.begin() + i);
+    }
+}
+
+// Only call once the frame's fence has signaled, the old ring and its descriptor may still be in use before that.
+bool Renderer::ReserveRing(AllocatedBuffer &ring, VkDescriptorSet descriptorSet, uint32_t binding, VkDeviceSize size,
+                           VkBufferUsageFlags usage, VkMemoryPropertyFlags propertyFlags)
+{
+    if (ring.buffer && ring.size >= size) {
+        return true;
+    }
+
+    if (ring.buffer) {
+        size = std::max(size, ring.size * 2);
+        DestroyBuffer(ring);
+    }
+    if (!CreateBuffer(usage, size, ring, propertyFlags)) {
+        return false;
+    }
 
+    VkDescriptorBufferInfo bufferInfo = {};
+    bufferInfo.buffer = ring.buffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = ring.size;
+
+    VkWriteDescriptorSet writeInfo = {};
+    writeInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeInfo.dstSet = descriptorSet;
+    writeInfo.dstBinding = binding;
+    writeInfo.dstArrayElement = 0;
+    writeInfo.descriptorCount = 1;
+    writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeInfo.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(m_device, 1, &writeInfo, 0, nullptr);
+
+    return true;
+}
+
+void Renderer::WriteSkinningDescriptors(const ModelAsset &asset)
+{
+    VkDescriptorBufferInfo bufferInfos[2] = {};
+    bufferInfos[0].buffer = asset.vertexBuffer.buffer;
+    bufferInfos[0].offset = 0;
+    bufferInfos[0].range = asset.vertexBuffer.size;
+    bufferInfos[1].buffer = m_skinnedVertexBuffer.buffer;
+    bufferInfos[1].offset = 0;
+    bufferInfos[1].range = m_skinnedVertexBuffer.size;
+
+    // The output is filled in once the first skinned instance needs it.
+    const uint32_t writeCount = m_skinnedVertexBuffer.buffer ? 2 : 1;
+    VkWriteDescriptorSet writeInfos[2] = {};
+    for (uint32_t i = 0; i < writeCount; ++i) {
+        writeInfos[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeInfos[i].dstSet = asset.skinningDescriptorSet;
+        writeInfos[i].dstBinding = i;
+        writeInfos[i].dstArrayElement = 0;
+        writeInfos[i].descriptorCount = 1;
+        writeInfos[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeInfos[i].pBufferInfo = &bufferInfos[i];
+    }
+
+    vkUpdateDescriptorSets(m_device, writeCount, writeInfos, 0, nullptr);
+}
+
+bool Renderer::ReserveSkinnedVertices(uint32_t vertexCount)
+{
+    const VkDeviceSize size = std::max(vertexCount, 1u) * sizeof(SkinnedVertex);
+    if (m_skinnedVertexBuffer.buffer && m_skinnedVertexBuffer.size >= size) {
+        return true;
+    }
+
+    // Unlike the rings there is only one copy, and frames still in flight use the descriptor sets
+    // that point at it.
+    VK_CHECK(vkDeviceWaitIdle(m_device));
+    VkDeviceSize newSize = size;
+    if (m_skinnedVertexBuffer.buffer) {
+        newSize = std::max(size, m_skinnedVertexBuffer.size * 2);
+        DestroyBuffer(m_skinnedVertexBuffer);
+    }
+    if (!CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, newSize, m_skinnedVertexBuffer,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+        return false;
+    }
+
+    for (const auto &asset : m_assets) {
+        if (asset->skinningDescriptorSet) {
+            WriteSkinningDescriptors(*asset);
+        }
+    }
+
+    VkDescriptorBufferInfo bufferInfo = {};
+    bufferInfo.buffer = m_skinnedVertexBuffer.buffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = m_skinnedVertexBuffer.size;
+
+    VkWriteDescriptorSet writeInfos[MAX_FRAMES_IN_FLIGHT] = {};
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        writeInfos[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeInfos[i].dstSet = m_globalDescriptors[i];
+        writeInfos[i].dstBinding = 2;
+        writeInfos[i].dstArrayElement = 0;
+        writeInfos[i].descriptorCount = 1;
+        writeInfos[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeInfos[i].pBufferInfo = &bufferInfo;
+    }
+    vkUpdateDescriptorSets(m_device, MAX_FRAMES_IN_FLIGHT, writeInfos, 0, nullptr);
     return true;
 }
 
@@ -586,7 +1082,7 @@ bool Renderer::InitVulkan(GLFWwindow *window)
 {
     return CreateInstance() && CreateSurface(window) && ChoosePhysicalDevice() && CreateDevice() &&
            CreateSwapchain(window) && CreateDepthBuffer() && CreateDescriptorSetLayouts() && CreateFrameData() &&
-           CreatePipelineLayouts() && CreateGraphicsPipelines();
+           CreatePipelineLayouts() && CreateGraphicsPipelines() && CreateComputePipelines() && CreateQueryPool();
 }
 
 static void TransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout,
@@ -615,38 +1111,65 @@ static void TransitionImageLayout(VkCommandBuffer commandBuffer, VkImage image,
     vkCmdPipelineBarrier2KHR(commandBuffer, &dependencyInfo);
 }
 
+static void PipelineBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess,
+                            VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+    VkMemoryBarrier2 memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    memoryBarrier.srcStageMask = srcStage;
+    memoryBarrier.srcAccessMask = srcAccess;
+    memoryBarrier.dstStageMask = dstStage;
+    memoryBarrier.dstAccessMask = dstAccess;
+
+    VkDependencyInfo dependencyInfo = {};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.memoryBarrierCount = 1;
+    dependencyInfo.pMemoryBarriers = &memoryBarrier;
+
+    vkCmdPipelineBarrier2KHR(commandBuffer, &dependencyInfo);
+}
+
+// Box around the transformed box, the extents go through the absolute value of the matrix.
+static BoundingBox TransformBounds(const glm::mat4 &transform, const BoundingBox &bounds)
+{
+    const glm::vec3 center = glm::vec3(transform * glm::vec4((bounds.min + bounds.max) * 0.5f, 1.0f));
+    const glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+    const glm::vec3 worldExtent = glm::abs(glm::vec3(transform[0])) * extent.x +
+                                  glm::abs(glm::vec3(transform[1])) * extent.y +
+                                  glm::abs(glm::vec3(transform[2])) * extent.z;
+    return {center - worldExtent, center + worldExtent};
+}
+
 //
 // Model Loader
 //
 
-static void LoadNode(const cgltf_data *gltf, const cgltf_node *node, Node &outNode)
+// Breadth first from the scene roots so parents are always added before their children.
+static void LoadNodes(const cgltf_data *gltf, NodeHierarchy &outNodes, std::vector<uint32_t> &outNodeMap)
 {
-    outNode.scale = node->has_scale ? glm::make_vec3(node->scale) : glm::vec3(1);
-    outNode.translation = node->has_translation ? glm::make_vec3(node->translation) : glm::vec3(0);
-    outNode.rotation = node->has_rotation ? glm::make_quat(node->rotation) : glm::quat();
-    outNode.matrix = node->has_matrix ? glm::make_mat4(node->matrix) : glm::mat4(1);
-    outNode.meshIndex = node->mesh ? cgltf_mesh_index(gltf, node->mesh) : UINT32_MAX;
-    outNode.nodeIndex = cgltf_node_index(gltf, node);
-    outNode.skinIndex = node->skin ? cgltf_skin_index(gltf, node->skin) : UINT32_MAX;
+    outNodeMap.assign(gltf->nodes_count, UINT32_MAX);
 
-    for (const auto *child = node->children; child != node->children + node->children_count; ++child) {
-        LoadNode(gltf, *child, outNode.children.emplace_back());
+    const auto *scene = gltf->scene;
+    std::vector<std::pair<const cgltf_node *, uint32_t>> queue;
+    for (const auto *node = scene->nodes; node != scene->nodes + scene->nodes_count; ++node) {
+        queue.push_back({*node, UINT32_MAX});
     }
-}
 
-static Node *GetNodeByIndex(Node &node, uint32_t nodeIndex)
-{
-    if (node.nodeIndex == nodeIndex) {
-        return &node;
-    }
-    for (auto &child : node.children) {
-        auto *res = GetNodeByIndex(child, nodeIndex);
-        if (res != nullptr) {
-            return res;
+    for (size_t head = 0; head < queue.size(); ++head) {
+        const auto [node, parent] = queue[head];
+        const uint32_t index = outNodes.AddNode(parent);
+        outNodes.scales[index] = node->has_scale ? glm::make_vec3(node->scale) : glm::vec3(1);
+        outNodes.translations[index] = node->has_translation ? glm::make_vec3(node->translation) : glm::vec3(0);
+        outNodes.rotations[index] = node->has_rotation ? glm::make_quat(node->rotation) : glm::quat();
+        outNodes.matrices[index] = node->has_matrix ? glm::make_mat4(node->matrix) : glm::mat4(1);
+        outNodes.meshIndices[index] = node->mesh ? cgltf_mesh_index(gltf, node->mesh) : UINT32_MAX;
+        outNodes.skinIndices[index] = node->skin ? cgltf_skin_index(gltf, node->skin) : UINT32_MAX;
+        outNodeMap[cgltf_node_index(gltf, node)] = index;
+
+        for (const auto *child = node->children; child != node->children + node->children_count; ++child) {
+            queue.push_back({*child, index});
         }
     }
-
-    return nullptr;
 }
 
 static inline InterpolationMethod ConvertInterpolation(cgltf_interpolation_type method)
@@ -661,16 +1184,15 @@ static inline InterpolationMethod ConvertInterpolation(cgltf_interpolation_type
     return InterpolationMethod_Linear;
 }
 
-static void LoadAnimations(const cgltf_data *gltf, Model &model)
+static void LoadAnimations(const cgltf_data *gltf, const std::vector<uint32_t> &nodeMap,
+                           const ModelLoadOptions &options, ModelAsset &asset)
 {
     for (const auto *anim = gltf->animations; anim != gltf->animations + gltf->animations_count; ++anim) {
-        Animation &outAnim = model.animations.emplace_back();
+        Animation &outAnim = asset.animations.emplace_back();
         for (const auto *chan = anim->channels; chan != anim->channels + anim->channels_count; ++chan) {
             const auto *sampler = chan->sampler;
-            uint32_t nodeIndex = cgltf_node_index(gltf, chan->target_node);
-
-            Node *node = GetNodeByIndex(model.rootNode, nodeIndex);
-            if (!node) {
+            uint32_t node = nodeMap[cgltf_node_index(gltf, chan->target_node)];
+            if (node == UINT32_MAX) {
                 continue;
             }
 
@@ -743,57 +1265,305 @@ static void LoadAnimations(const cgltf_data *gltf, Model &model)
                 }
             }
         }
+
+        if (BakeAnimation(outAnim, options.bake, outAnim.baked)) {
+            printf("Baked animation %u at %.0f Hz, %u frames: %.1f KiB raw, %.1f KiB baked\n",
+                   (uint32_t)(anim - gltf->animations), outAnim.baked.sampleRate, outAnim.baked.frameCount,
+                   outAnim.GetMemorySize() / 1024.0, outAnim.baked.GetMemorySize() / 1024.0);
+            BuildBatchAnimation(outAnim, outAnim.batch);
+        }
+
+        float maxError = 0.0f;
+        if (CompressAnimation(outAnim, asset.nodes, options.compression, outAnim.compressed, maxError)) {
+            size_t rawSize = outAnim.GetMemorySize();
+            size_t compressedSize = outAnim.compressed.GetMemorySize();
+            printf("Compressed animation %u: %.1f KiB raw, %.1f KiB compressed (%.1fx), max error %f\n",
+                   (uint32_t)(anim - gltf->animations), rawSize / 1024.0, compressedSize / 1024.0,
+                   (double)rawSize / (double)compressedSize, maxError);
+        }
     }
 }
 
-bool Renderer::LoadModel(const char *path)
+static bool IsRigid(const glm::mat4 &matrix)
 {
-    cgltf_options options = {};
-    cgltf_data *gltf = nullptr;
+    const float epsilon = 1e-3f;
+    for (uint32_t i = 0; i < 3; ++i) {
+        if (glm::abs(glm::length(glm::vec3(matrix[i])) - 1.0f) > epsilon) {
+            return false;
+        }
+    }
+    return glm::determinant(glm::mat3(matrix)) > 0.0f;
+}
 
-    if (cgltf_parse_file(&options, path, &gltf) == cgltf_result_success) {
-        if (cgltf_load_buffers(&options, gltf, path) == cgltf_result_success) {
-            Model &model = m_models.emplace_back();
-            std::vector<Vertex> vertices;
-            std::vector<uint32_t> indices;
+// Skinned meshes are drawn with their skeleton's world matrix rather than their own node's, so every
+// node sharing a skin can use the same palette.
+static inline glm::mat4 GetSkeletonMatrix(const Skin &skin, const glm::mat4 *worldMatrices)
+{
+    return skin.skeleton != UINT32_MAX ? worldMatrices[skin.skeleton] : glm::mat4(1);
+}
+
+// Dual quaternions can't carry scale, only skins that stay rigid in the bind pose and through every
+// clip get them.
+static PaletteFormat ChoosePaletteFormat(const ModelAsset &asset, const Skin &skin, PaletteFormat requested)
+{
+    if (requested != PaletteFormat_DualQuat) {
+        return requested;
+    }
 
-            const auto *scene = gltf->scene;
-            auto &rootNode = model.rootNode;
-            for (const auto *node = scene->nodes; node != scene->nodes + scene->nodes_count; ++node) {
-                LoadNode(gltf, *node, rootNode.children.emplace_back());
+    const auto &nodes = asset.nodes;
+    const glm::mat4 rootNodeInverse = glm::inverse(GetSkeletonMatrix(skin, nodes.worldMatrices.data()));
+    for (uint32_t i = 0; i < skin.joints.size(); ++i) {
+        if (!IsRigid(rootNodeInverse * nodes.worldMatrices[skin.joints[i]] * skin.inverseBindMatrices[i])) {
+            return PaletteFormat_Mat3x4;
+        }
+    }
+
+    for (const auto &animation : asset.animations) {
+        for (const auto &sampler : animation.samplers) {
+            for (const auto &scale : sampler.scale.values) {
+                if (glm::length(scale - glm::vec3(1)) > 1e-3f) {
+                    return PaletteFormat_Mat3x4;
+                }
             }
+        }
+    }
 
-            for (const auto *mesh = gltf->meshes; mesh != gltf->meshes + gltf->meshes_count; ++mesh) {
-                const uint32_t primitiveOffset = (uint32_t)model.primitives.size();
-                for (const auto *prim = mesh->primitives; prim != mesh->primitives + mesh->primitives_count; ++prim) {
-                    uint32_t positionCount = 0;
-                    const float *positions = nullptr;
-                    const float *normals = nullptr;
-                    const float *texCoords = nullptr;
-                    const uint16_t *joints = nullptr;
-                    const float *weights = nullptr;
+    return PaletteFormat_DualQuat;
+}
 
-                    for (const auto *attrib = prim->attributes; attrib != prim->attributes + prim->attributes_count;
-                         ++attrib) {
-                        const auto *accessor = attrib->data;
-                        const auto *bufferView = accessor->buffer_view;
-                        const auto *buffer = bufferView->buffer;
-                        const auto *data = ((uint8_t *)buffer->data) + accessor->offset + bufferView->offset;
+// Baked palettes only move skinned primitives, a mesh node without a skin below an animated node would
+// stay in its rest pose.
+static bool HasAnimatedRigidMeshNodes(const ModelAsset &asset)
+{
+    std::vector<uint8_t> animated(asset.nodes.GetCount(), 0);
+    for (const auto &animation : asset.animations) {
+        for (const auto &sampler : animation.samplers) {
+            animated[sampler.node] = 1;
+        }
+    }
+    // Parents always come before their children.
+    for (uint32_t node = 0; node < asset.nodes.GetCount(); ++node) {
+        const uint32_t parent = asset.nodes.parents[node];
+        if (parent != UINT32_MAX && animated[parent]) {
+            animated[node] = 1;
+        }
+    }
 
-                        switch (attrib->type) {
-                        case cgltf_attribute_type_position:
-                            assert(accessor->component_type == cgltf_component_type_r_32f);
-                            assert(accessor->type == cgltf_type_vec3);
-                            positions = (const float *)data;
-                            positionCount = accessor->count;
-                            break;
-                        case cgltf_attribute_type_normal:
-                            assert(accessor->component_type == cgltf_component_type_r_32f);
-                            assert(accessor->type == cgltf_type_vec3);
-                            normals = (const float *)data;
-                            break;
-                        case cgltf_attribute_type_texcoord:
-                            assert(accessor->component_type == cgltf_component_type_r_32f);
+    for (uint32_t node : asset.meshNodes) {
+        if (asset.nodes.skinIndices[node] == UINT32_MAX && animated[node]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Samples every clip on a copy of the rest pose and packs each frame's palettes. They are relative to the
+// skeleton's rest pose transform, so drawing needs nothing but the instance transform and motion of the
+// skeleton node itself ends up in the palette.
+static void BakeVatClips(ModelAsset &asset, const VatSettings &settings, std::vector<glm::vec4> &outPalettes)
+{
+    const PaletteKernel kernel = GetSupportedPaletteKernel();
+    const glm::mat4 *restMatrices = asset.nodes.worldMatrices.data();
+    for (const auto &animation : asset.animations) {
+        auto &clip = asset.vatClips.emplace_back();
+        clip.paletteBase = (uint32_t)outPalettes.size();
+        clip.frameCount = (uint32_t)ceilf(animation.endTime * settings.sampleRate) + 1;
+        clip.sampleRate = settings.sampleRate;
+        outPalettes.resize(outPalettes.size() + (size_t)clip.frameCount * asset.paletteSize);
+
+        NodeHierarchy nodes = asset.nodes;
+        for (uint32_t frame = 0; frame < clip.frameCount; ++frame) {
+            const float time = glm::min((float)frame / settings.sampleRate, animation.endTime);
+            for (const auto &sampler : animation.samplers) {
+                const uint32_t node = sampler.node;
+                sampler.scale.GetValueAtTime(time, nodes.scales[node]);
+                sampler.translation.GetValueAtTime(time, nodes.translations[node]);
+                sampler.rotation.GetValueAtTime(time, nodes.rotations[node]);
+                nodes.MarkDirty(node);
+            }
+            nodes.UpdateWorldMatrices();
+
+            // Drawn with the instance transform alone, so the bounds live in model space.
+            for (const auto &nodePrimitive : asset.nodePrimitives) {
+                const uint32_t skinIndex = nodes.skinIndices[asset.meshNodes[nodePrimitive.meshNode]];
+                const auto &prim = asset.primitives[nodePrimitive.primitive];
+                if (skinIndex == UINT32_MAX) {
+                    continue;
+                }
+
+                const auto &skin = asset.skins[skinIndex];
+                for (uint32_t i = 0; i < prim.jointBoundsCount; ++i) {
+                    const auto &joint = asset.jointBounds[prim.jointBoundsOffset + i];
+                    const glm::mat4 skinMatrix =
+                        nodes.worldMatrices[skin.joints[joint.joint]] * skin.inverseBindMatrices[joint.joint];
+                    asset.vatBounds.Extend(TransformBounds(skinMatrix, joint.bounds));
+                }
+            }
+
+            glm::vec4 *palettes = &outPalettes[clip.paletteBase + (size_t)frame * asset.paletteSize];
+            for (const auto &skin : asset.skins) {
+                const glm::mat4 rootNodeInverse = glm::inverse(GetSkeletonMatrix(skin, restMatrices));
+                BuildPalette(kernel, skin.paletteFormat, rootNodeInverse, nodes.worldMatrices.data(),
+                             skin.joints.data(), skin.inverseBindMatrices.data(), (uint32_t)skin.joints.size(),
+                             palettes + skin.paletteOffset);
+            }
+        }
+
+        printf("Baked VAT for animation %u at %.0f Hz, %u frames: %.1f KiB\n",
+               (uint32_t)(asset.vatClips.size() - 1), clip.sampleRate, clip.frameCount,
+               (double)clip.frameCount * asset.paletteSize * sizeof(glm::vec4) / 1024.0);
+    }
+}
+
+// Fills the levels after the first one of a primitive, each one simplified from the one before and
+// indexing the same vertices. Skinned vertices are grouped by the joint with the largest weight, so
+// collapses never pull a vertex over to a part of the mesh that moves differently.
+static void BuildMeshLods(const MeshLodSettings &settings, const std::vector<Vertex> &vertices,
+                          std::vector<uint32_t> levels[MAX_MESH_LODS], Primitive &prim)
+{
+    const uint32_t vertexCount = (uint32_t)vertices.size();
+    std::vector<glm::vec3> positions(vertexCount);
+    std::vector<uint32_t> groups(vertexCount, 0);
+    for (uint32_t i = 0; i < vertexCount; ++i) {
+        const auto &vertex = vertices[i];
+        positions[i] = vertex.position;
+        float weight = 0.0f;
+        for (uint32_t j = 0; j < 4; ++j) {
+            if (vertex.weights[j] > weight) {
+                weight = vertex.weights[j];
+                groups[i] = (uint32_t)vertex.joints[j];
+            }
+        }
+    }
+
+    const float maxError = settings.maxError * glm::length(prim.bounds.max - prim.bounds.min);
+    while (prim.lodCount < MAX_MESH_LODS) {
+        const auto &previous = levels[prim.lodCount - 1];
+        auto &lodIndices = levels[prim.lodCount];
+        lodIndices = previous;
+        const uint32_t targetCount = (uint32_t)(previous.size() / 3 * settings.reduction) * 3;
+        const float error =
+            SimplifyMesh(positions.data(), groups.data(), vertexCount, lodIndices, targetCount, maxError);
+        // Not worth a level if the error limit stopped it early on.
+        if (lodIndices.empty() || lodIndices.size() > previous.size() * 0.9f) {
+            lodIndices.clear();
+            break;
+        }
+
+        // Errors of consecutive levels add up at most.
+        prim.lods[prim.lodCount].error = prim.lods[prim.lodCount - 1].error + error;
+        prim.lodCount++;
+    }
+}
+
+// Folds the lower hemisphere over the upper one of the octahedron, -1..1 on both axes.
+static glm::vec2 EncodeOctahedral(glm::vec3 normal)
+{
+    const float sum = glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z);
+    if (sum <= 0.0f) {
+        return glm::vec2(0);
+    }
+
+    glm::vec2 p = glm::vec2(normal.x, normal.y) / sum;
+    if (normal.z < 0.0f) {
+        p = glm::vec2((1.0f - glm::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+                      (1.0f - glm::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return p;
+}
+
+// Weights are rounded so they still add up to exactly 255, the rounding error goes to the largest.
+static bool PackVertices(const std::vector<Vertex> &vertices, glm::vec4 positionQuantization,
+                         std::vector<PackedVertex> &outVertices)
+{
+    outVertices.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        const auto &vertex = vertices[i];
+        auto &packed = outVertices[i];
+
+        const glm::vec3 position = (vertex.position - glm::vec3(positionQuantization)) / positionQuantization.w;
+        const glm::vec2 normal = EncodeOctahedral(vertex.normal);
+        for (uint32_t k = 0; k < 3; ++k) {
+            packed.position[k] = (uint16_t)glm::round(glm::clamp(position[k], 0.0f, 1.0f) * 65535.0f);
+        }
+        packed.position[3] = 0;
+        packed.normal[0] = (int16_t)glm::round(glm::clamp(normal.x, -1.0f, 1.0f) * 32767.0f);
+        packed.normal[1] = (int16_t)glm::round(glm::clamp(normal.y, -1.0f, 1.0f) * 32767.0f);
+        packed.texCoord = glm::packHalf2x16(vertex.texCoord);
+
+        int weightSum = 0;
+        uint32_t largest = 0;
+        for (uint32_t k = 0; k < 4; ++k) {
+            if (vertex.joints[k] < 0 || vertex.joints[k] > 255) {
+                LOG_ERROR("Joint index %d doesn't fit the packed vertex format.", vertex.joints[k]);
+                return false;
+            }
+            packed.joints[k] = (uint8_t)vertex.joints[k];
+            packed.weights[k] = (uint8_t)glm::round(glm::clamp(vertex.weights[k], 0.0f, 1.0f) * 255.0f);
+            weightSum += packed.weights[k];
+            largest = packed.weights[k] > packed.weights[largest] ? k : largest;
+        }
+        if (weightSum > 0) {
+            packed.weights[largest] = (uint8_t)(packed.weights[largest] + 255 - weightSum);
+        }
+    }
+    return true;
+}
+
+bool Renderer::LoadModel(const char *path, const ModelLoadOptions &loadOptions, const ModelAsset *&outAsset)
+{
+    outAsset = nullptr;
+    cgltf_options options = {};
+    cgltf_data *gltf = nullptr;
+
+    if (cgltf_parse_file(&options, path, &gltf) == cgltf_result_success) {
+        if (cgltf_load_buffers(&options, gltf, path) == cgltf_result_success) {
+            auto &asset = *m_assets.emplace_back(std::make_unique<ModelAsset>());
+            std::vector<Vertex> vertices;
+            std::vector<uint16_t> indices16;
+            std::vector<uint32_t> indices32;
+
+            std::vector<uint32_t> nodeMap;
+            LoadNodes(gltf, asset.nodes, nodeMap);
+            for (uint32_t node = 0; node < asset.nodes.GetCount(); ++node) {
+                if (asset.nodes.meshIndices[node] != UINT32_MAX) {
+                    asset.meshNodes.push_back(node);
+                }
+            }
+
+            for (const auto *mesh = gltf->meshes; mesh != gltf->meshes + gltf->meshes_count; ++mesh) {
+                const uint32_t primitiveOffset = (uint32_t)asset.primitives.size();
+                for (const auto *prim = mesh->primitives; prim != mesh->primitives + mesh->primitives_count; ++prim) {
+                    uint32_t positionCount = 0;
+                    const cgltf_accessor *positionAccessor = nullptr;
+                    const float *positions = nullptr;
+                    const float *normals = nullptr;
+                    const float *texCoords = nullptr;
+                    const uint16_t *joints = nullptr;
+                    const float *weights = nullptr;
+
+                    for (const auto *attrib = prim->attributes; attrib != prim->attributes + prim->attributes_count;
+                         ++attrib) {
+                        const auto *accessor = attrib->data;
+                        const auto *bufferView = accessor->buffer_view;
+                        const auto *buffer = bufferView->buffer;
+                        const auto *data = ((uint8_t *)buffer->data) + accessor->offset + bufferView->offset;
+
+                        switch (attrib->type) {
+                        case cgltf_attribute_type_position:
+                            assert(accessor->component_type == cgltf_component_type_r_32f);
+                            assert(accessor->type == cgltf_type_vec3);
+                            positions = (const float *)data;
+                            positionCount = accessor->count;
+                            positionAccessor = accessor;
+                            break;
+                        case cgltf_attribute_type_normal:
+                            assert(accessor->component_type == cgltf_component_type_r_32f);
+                            assert(accessor->type == cgltf_type_vec3);
+                            normals = (const float *)data;
+                            break;
+                        case cgltf_attribute_type_texcoord:
+                            assert(accessor->component_type == cgltf_component_type_r_32f);
                             assert(accessor->type == cgltf_type_vec2);
                             texCoords = (const float *)data;
                             break;
@@ -810,9 +1580,21 @@ bool Renderer::LoadModel(const char *path)
                         }
                     }
 
-                    const uint32_t indexOffset = (uint32_t)indices.size();
-                    const uint32_t vertexOffset = (uint32_t)vertices.size();
+                    std::vector<Vertex> loadedVertices(positionCount);
+                    for (uint32_t i = 0; i < positionCount; ++i) {
+                        Vertex &v = loadedVertices[i];
+                        v.position = glm::make_vec3(&positions[i * 3]);
+                        v.normal = normals ? glm::make_vec3(&normals[i * 3]) : glm::vec3(0);
+                        v.texCoord = texCoords ? glm::make_vec2(&texCoords[i * 2]) : glm::vec2(0);
+                        v.joints = joints ? glm::ivec4(joints[i * 4 + 0], joints[i * 4 + 1], joints[i * 4 + 2],
+                                                       joints[i * 4 + 3])
+                                          : glm::ivec4(0);
+                        v.weights = weights ? glm::make_vec4(&weights[i * 4]) : glm::vec4(0);
+                    }
 
+                    // Indices stay local to the primitive until they are written out.
+                    std::vector<uint32_t> levels[MAX_MESH_LODS];
+                    auto &primIndices = levels[0];
                     if (prim->indices) {
                         const auto *accessor = prim->indices;
                         const auto *bufferView = accessor->buffer_view;
@@ -822,57 +1604,200 @@ bool Renderer::LoadModel(const char *path)
                         switch (accessor->component_type) {
                         case cgltf_component_type_r_32u:
                             for (uint32_t i = 0; i < accessor->count; ++i) {
-                                indices.push_back(vertexOffset + ((const uint32_t *)data)[i]);
+                                primIndices.push_back(((const uint32_t *)data)[i]);
                             }
                             break;
                         case cgltf_component_type_r_16u:
                             for (uint32_t i = 0; i < accessor->count; ++i) {
-                                indices.push_back(vertexOffset + ((const uint16_t *)data)[i]);
+                                primIndices.push_back(((const uint16_t *)data)[i]);
                             }
                             break;
                         }
                     } else {
                         for (uint32_t i = 0; i < positionCount; ++i) {
-                            indices.push_back(vertexOffset + i);
+                            primIndices.push_back(i);
                         }
                     }
+                    const VertexCacheStats before =
+                        AnalyzeVertexCache(primIndices.data(), primIndices.size(), positionCount, VERTEX_CACHE_SIZE);
 
+                    // Exporters split vertices along every face more often than they need to.
+                    std::vector<uint32_t> remap;
+                    std::vector<Vertex> primVertices(
+                        WeldVertices(loadedVertices.data(), sizeof(Vertex), positionCount, remap));
                     for (uint32_t i = 0; i < positionCount; ++i) {
-                        Vertex v = {};
-                        v.position = glm::make_vec3(&positions[i * 3]);
-                        v.normal = normals ? glm::make_vec3(&normals[i * 3]) : glm::vec3(0);
-                        v.texCoord = texCoords ? glm::make_vec2(&texCoords[i * 2]) : glm::vec2(0);
-                        v.joints = joints ? glm::ivec4(joints[i * 4 + 0], joints[i * 4 + 1], joints[i * 4 + 2],
-                                                       joints[i * 4 + 3])
-                                          : glm::ivec4(0);
-                        v.weights = weights ? glm::make_vec4(&weights[i * 4]) : glm::vec4(0);
-                        vertices.push_back(v);
+                        primVertices[remap[i]] = loadedVertices[i];
+                    }
+                    for (auto &index : primIndices) {
+                        index = remap[index];
+                    }
+                    const uint32_t weldedCount = (uint32_t)primVertices.size();
+                    OptimizeVertexCache(primIndices.data(), primIndices.size(), weldedCount);
+
+                    auto &outPrim = asset.primitives.emplace_back();
+                    outPrim.lodCount = 1;
+
+                    // Position accessors are required to carry min and max, not every exporter bothers.
+                    if (positionAccessor && positionAccessor->has_min && positionAccessor->has_max) {
+                        outPrim.bounds = {glm::make_vec3(positionAccessor->min), glm::make_vec3(positionAccessor->max)};
+                    } else {
+                        for (const auto &vertex : primVertices) {
+                            outPrim.bounds.Extend(vertex.position);
+                        }
+                    }
+
+                    // Skinned primitives are bounded by a box per joint around the vertices it moves, in bind
+                    // space, so the current palette can carry them along.
+                    outPrim.jointBoundsOffset = (uint32_t)asset.jointBounds.size();
+                    if (joints && weights) {
+                        std::vector<BoundingBox> jointBoxes;
+                        for (const auto &vertex : primVertices) {
+                            for (uint32_t j = 0; j < 4; ++j) {
+                                if (vertex.weights[j] > 0.0f) {
+                                    const uint32_t joint = (uint32_t)vertex.joints[j];
+                                    jointBoxes.resize(glm::max((uint32_t)jointBoxes.size(), joint + 1));
+                                    jointBoxes[joint].Extend(vertex.position);
+                                }
+                            }
+                        }
+                        for (uint32_t joint = 0; joint < jointBoxes.size(); ++joint) {
+                            if (!jointBoxes[joint].IsEmpty()) {
+                                asset.jointBounds.push_back({joint, jointBoxes[joint]});
+                            }
+                        }
+                    }
+                    outPrim.jointBoundsCount = (uint32_t)asset.jointBounds.size() - outPrim.jointBoundsOffset;
+
+                    if (loadOptions.meshLod.enabled) {
+                        BuildMeshLods(loadOptions.meshLod, primVertices, levels, outPrim);
+                        for (uint32_t lod = 1; lod < outPrim.lodCount; ++lod) {
+                            OptimizeVertexCache(levels[lod].data(), levels[lod].size(), weldedCount);
+                        }
                     }
 
-                    auto &outPrim = model.primitives.emplace_back();
-                    outPrim.indexOffset = indexOffset;
-                    outPrim.indexCount = (uint32_t)indices.size() - indexOffset;
+                    // Vertices go in the order level 0 first uses them, the coarser levels use a subset.
+                    outPrim.vertexOffset = (uint32_t)vertices.size();
+                    outPrim.vertexCount =
+                        OptimizeVertexFetch(primIndices.data(), primIndices.size(), weldedCount, remap);
+                    vertices.resize(vertices.size() + outPrim.vertexCount);
+                    for (uint32_t i = 0; i < weldedCount; ++i) {
+                        if (remap[i] != UINT32_MAX) {
+                            vertices[outPrim.vertexOffset + remap[i]] = primVertices[i];
+                        }
+                    }
+
+                    // Primitive restart is off, so all of 0xffff is a valid 16 bit index.
+                    outPrim.indexType = outPrim.vertexCount <= 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+                    for (uint32_t lod = 0; lod < outPrim.lodCount; ++lod) {
+                        auto &meshLod = outPrim.lods[lod];
+                        meshLod.indexCount = (uint32_t)levels[lod].size();
+                        for (auto &index : levels[lod]) {
+                            index = remap[index];
+                        }
+                        if (outPrim.indexType == VK_INDEX_TYPE_UINT16) {
+                            meshLod.indexOffset = (uint32_t)indices16.size();
+                            for (uint32_t index : levels[lod]) {
+                                indices16.push_back((uint16_t)index);
+                            }
+                        } else {
+                            meshLod.indexOffset = (uint32_t)indices32.size();
+                            indices32.insert(indices32.end(), levels[lod].begin(), levels[lod].end());
+                        }
+                    }
+
+                    const VertexCacheStats after = AnalyzeVertexCache(primIndices.data(), primIndices.size(),
+                                                                      outPrim.vertexCount, VERTEX_CACHE_SIZE);
+                    printf("Primitive %u: %u -> %u vertices, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %u bit indices\n",
+                           (uint32_t)asset.primitives.size() - 1, positionCount, outPrim.vertexCount, before.acmr,
+                           after.acmr, before.atvr, after.atvr, outPrim.indexType == VK_INDEX_TYPE_UINT16 ? 16 : 32);
                 }
 
-                auto &outMesh = model.meshes.emplace_back();
+                auto &outMesh = asset.meshes.emplace_back();
                 outMesh.primitiveOffset = primitiveOffset;
-                outMesh.primitiveCount = (uint32_t)model.primitives.size() - primitiveOffset;
+                outMesh.primitiveCount = (uint32_t)asset.primitives.size() - primitiveOffset;
+            }
+
+            for (uint32_t i = 0; i < asset.meshNodes.size(); ++i) {
+                const auto &mesh = asset.meshes[asset.nodes.meshIndices[asset.meshNodes[i]]];
+                for (uint32_t p = 0; p < mesh.primitiveCount; ++p) {
+                    asset.nodePrimitives.push_back({i, mesh.primitiveOffset + p});
+                }
+            }
+
+            // The primitives of a mesh are loaded one after the other, so their vertices are one range.
+            asset.skinnedVertexBases.assign(asset.meshNodes.size(), 0);
+            for (uint32_t i = 0; i < asset.meshNodes.size(); ++i) {
+                const uint32_t node = asset.meshNodes[i];
+                const auto &mesh = asset.meshes[asset.nodes.meshIndices[node]];
+                if (asset.nodes.skinIndices[node] == UINT32_MAX || mesh.primitiveCount == 0) {
+                    continue;
+                }
+
+                const auto &first = asset.primitives[mesh.primitiveOffset];
+                const auto &last = asset.primitives[mesh.primitiveOffset + mesh.primitiveCount - 1];
+                asset.skinnedVertexBases[i] = asset.skinnedVertexCount - first.vertexOffset;
+                asset.skinnedVertexCount += last.vertexOffset + last.vertexCount - first.vertexOffset;
             }
 
-            const VkDeviceSize vertexBufferSize = sizeof(vertices[0]) * vertices.size();
-            const VkDeviceSize indexBufferSize = sizeof(indices[0]) * indices.size();
-            if (!CreateBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertexBufferSize, model.vertexBuffer)) {
+            // Bind pose bounds, loose enough for picking an animation LOD.
+            if (!vertices.empty()) {
+                glm::vec3 boundsMin = vertices[0].position;
+                glm::vec3 boundsMax = vertices[0].position;
+                for (const auto &vertex : vertices) {
+                    boundsMin = glm::min(boundsMin, vertex.position);
+                    boundsMax = glm::max(boundsMax, vertex.position);
+                }
+                asset.boundsCenter = (boundsMin + boundsMax) * 0.5f;
+                asset.boundsRadius = glm::length(boundsMax - boundsMin) * 0.5f;
+
+                const glm::vec3 extent = boundsMax - boundsMin;
+                const float scale = glm::max(extent.x, glm::max(extent.y, extent.z));
+                asset.positionQuantization = glm::vec4(boundsMin, scale > 0.0f ? scale : 1.0f);
+            }
+
+            std::vector<PackedVertex> packedVertices;
+            if (!PackVertices(vertices, asset.positionQuantization, packedVertices)) {
                 return false;
             }
-            memcpy(model.vertexBuffer.data, &vertices[0], vertexBufferSize);
-            if (!CreateBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indexBufferSize, model.indexBuffer)) {
+            printf("Packed %u vertices: %.1f KiB, %.1f KiB unpacked\n", (uint32_t)vertices.size(),
+                   (double)packedVertices.size() * sizeof(PackedVertex) / 1024.0,
+                   (double)vertices.size() * sizeof(Vertex) / 1024.0);
+
+            // 32 bit indices start on the next multiple of 4 after the 16 bit ones.
+            asset.wideIndexOffset = (sizeof(uint16_t) * indices16.size() + 3) & ~(VkDeviceSize)3;
+            std::vector<uint8_t> indexData(asset.wideIndexOffset + sizeof(uint32_t) * indices32.size());
+            if (!indices16.empty()) {
+                memcpy(&indexData[0], &indices16[0], sizeof(uint16_t) * indices16.size());
+            }
+            if (!indices32.empty()) {
+                memcpy(&indexData[asset.wideIndexOffset], &indices32[0], sizeof(uint32_t) * indices32.size());
+            }
+
+            const VkDeviceSize vertexBufferSize = sizeof(packedVertices[0]) * packedVertices.size();
+            if (!UploadBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              &packedVertices[0], vertexBufferSize, asset.vertexBuffer) ||
+                !UploadBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &indexData[0], indexData.size(), asset.indexBuffer)) {
                 return false;
             }
-            memcpy(model.indexBuffer.data, &indices[0], indexBufferSize);
+
+            asset.vertexCount = (uint32_t)vertices.size();
+            if (gltf->skins_count) {
+                VkDescriptorSetAllocateInfo allocateInfo = {};
+                allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+                allocateInfo.descriptorPool = m_descriptorPool;
+                allocateInfo.descriptorSetCount = 1;
+                allocateInfo.pSetLayouts = &m_skinningDescriptorsLayout;
+                VK_CHECK(vkAllocateDescriptorSets(m_device, &allocateInfo, &asset.skinningDescriptorSet));
+                WriteSkinningDescriptors(asset);
+            }
+
+            // Skins look at the animations to pick a palette format.
+            LoadAnimations(gltf, nodeMap, loadOptions, asset);
+            asset.nodes.UpdateWorldMatrices();
 
             { // Load skins
                 for (const auto *skin = gltf->skins; skin != gltf->skins + gltf->skins_count; ++skin) {
-                    auto &outSkin = model.skins.emplace_back();
+                    auto &outSkin = asset.skins.emplace_back();
 
                     const auto *accessor = skin->inverse_bind_matrices;
                     const auto *bufferView = accessor->buffer_view;
@@ -880,179 +1805,1029 @@ bool Renderer::LoadModel(const char *path)
                     const auto *data = ((const uint8_t *)buffer->data) + bufferView->offset + accessor->offset;
                     const float *values = (const float *)data;
 
-                    uint32_t jointsCount = accessor->count;
-                    uint32_t jointsBufferSize = jointsCount * sizeof(glm::mat4);
-
-                    { // Per frame written data.
-
-                        VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT] = {};
-                        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-                            layouts[i] = m_jointsDescriptorsLayout;
-                        }
-
-                        VkDescriptorSetAllocateInfo allocateInfo = {};
-                        allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-                        allocateInfo.descriptorPool = m_descriptorPool;
-                        allocateInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
-                        allocateInfo.pSetLayouts = &layouts[0];
-
-                        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocateInfo, &outSkin.descriptorSet[0]));
+                    for (uint32_t i = 0; i < accessor->count; ++i) {
+                        uint32_t nodeIndex = cgltf_node_index(gltf, skin->joints[i]);
+                        outSkin.inverseBindMatrices.push_back(glm::make_mat4(&values[i * 16]));
+                        outSkin.joints.push_back(nodeMap[nodeIndex]);
+                    }
 
-                        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-                            outSkin.jointMatrices[i].resize(jointsCount);
+                    // Without a skeleton root the palette is in model space.
+                    if (skin->skeleton) {
+                        outSkin.skeleton = nodeMap[cgltf_node_index(gltf, skin->skeleton)];
+                    }
 
-                            if (!CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, jointsBufferSize,
-                                              outSkin.jointMatricesBuffer[i])) {
-                                return false;
-                            }
+                    outSkin.paletteFormat = ChoosePaletteFormat(asset, outSkin, loadOptions.paletteFormat);
+                    outSkin.paletteOffset = asset.paletteSize;
+                    asset.paletteSize += (uint32_t)outSkin.joints.size() * GetPaletteStride(outSkin.paletteFormat);
+                }
 
-                            VkDescriptorBufferInfo bufferInfo = {};
-                            bufferInfo.buffer = outSkin.jointMatricesBuffer[i].buffer;
-                            bufferInfo.offset = 0;
-                            bufferInfo.range = outSkin.jointMatricesBuffer[i].size;
-
-                            VkWriteDescriptorSet writeInfo = {};
-                            writeInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                            writeInfo.dstSet = outSkin.descriptorSet[i];
-                            writeInfo.dstBinding = 0;
-                            writeInfo.dstArrayElement = 0;
-                            writeInfo.descriptorCount = 1;
-                            writeInfo.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-                            writeInfo.pBufferInfo = &bufferInfo;
-
-                            vkUpdateDescriptorSets(m_device, 1, &writeInfo, 0, nullptr);
-                        }
+                // The farthest corner of a joint box in joint space bounds every vertex inside it.
+                for (const auto &nodePrimitive : asset.nodePrimitives) {
+                    const uint32_t skinIndex = asset.nodes.skinIndices[asset.meshNodes[nodePrimitive.meshNode]];
+                    const auto &prim = asset.primitives[nodePrimitive.primitive];
+                    if (skinIndex == UINT32_MAX) {
+                        continue;
                     }
 
-                    for (uint32_t i = 0; i < accessor->count; ++i) {
-                        uint32_t nodeIndex = cgltf_node_index(gltf, skin->joints[i]);
-                        outSkin.inverseBindMatrices.push_back(glm::make_mat4(&values[i * 16]));
-                        outSkin.joints.push_back(GetNodeByIndex(model.rootNode, nodeIndex));
+                    auto &skin = asset.skins[skinIndex];
+                    for (uint32_t i = 0; i < prim.jointBoundsCount; ++i) {
+                        const auto &joint = asset.jointBounds[prim.jointBoundsOffset + i];
+                        for (uint32_t corner = 0; corner < 8; ++corner) {
+                            const glm::vec3 point = glm::vec3(corner & 1 ? joint.bounds.max.x : joint.bounds.min.x,
+                                                              corner & 2 ? joint.bounds.max.y : joint.bounds.min.y,
+                                                              corner & 4 ? joint.bounds.max.z : joint.bounds.min.z);
+                            const glm::vec4 local = skin.inverseBindMatrices[joint.joint] * glm::vec4(point, 1.0f);
+                            skin.jointRadius = glm::max(skin.jointRadius, glm::length(glm::vec3(local)));
+                        }
                     }
                 }
             }
 
-            LoadAnimations(gltf, model);
+            const bool bakeVat = loadOptions.vat.enabled && asset.paletteSize > 0 && !asset.animations.empty();
+            if (bakeVat && HasAnimatedRigidMeshNodes(asset)) {
+                printf("Not baking VAT, animated mesh nodes without a skin would be left behind\n");
+            } else if (bakeVat) {
+                std::vector<glm::vec4> palettes;
+                BakeVatClips(asset, loadOptions.vat, palettes);
+
+                const VkDeviceSize vatBufferSize = sizeof(palettes[0]) * palettes.size();
+                if (!UploadBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, palettes.data(), vatBufferSize,
+                                  asset.vatBuffer)) {
+                    return false;
+                }
+
+                VkDescriptorSetAllocateInfo allocateInfo = {};
+                allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+                allocateInfo.descriptorPool = m_descriptorPool;
+                allocateInfo.descriptorSetCount = 1;
+                allocateInfo.pSetLayouts = &m_paletteDescriptorsLayout;
+                VK_CHECK(vkAllocateDescriptorSets(m_device, &allocateInfo, &asset.vatDescriptorSet));
+
+                VkDescriptorBufferInfo bufferInfo = {};
+                bufferInfo.buffer = asset.vatBuffer.buffer;
+                bufferInfo.offset = 0;
+                bufferInfo.range = asset.vatBuffer.size;
+
+                VkWriteDescriptorSet bufferWrite = {};
+                bufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                bufferWrite.dstSet = asset.vatDescriptorSet;
+                bufferWrite.dstBinding = 0;
+                bufferWrite.dstArrayElement = 0;
+                bufferWrite.descriptorCount = 1;
+                bufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                bufferWrite.pBufferInfo = &bufferInfo;
+                vkUpdateDescriptorSets(m_device, 1, &bufferWrite, 0, nullptr);
+            }
+            // Doesn't wait for the copies, the next frame picks them up.
+            if (SubmitUploads()) {
+                outAsset = &asset;
+            }
         }
 
         cgltf_free(gltf);
     }
-    return true;
+    return outAsset != nullptr;
 }
 
 //
 // Rendering logic
 //
 
-void Model::UpdateAnimations(float dt)
+void ModelInstance::AdvanceAnimation(float dt)
 {
     if (playingAnimation == nullptr) {
         return;
     }
 
-    auto *animation = playingAnimation;
-    animation_t += (float)dt;
+    animation_t += dt;
 
     // TODO: Wrapping behaviour should be configured.
-    if (animation_t > animation->endTime) {
-        animation_t -= animation->endTime;
+    // Throttled models advance by several frames at once, so this may wrap more than once.
+    if (animation_t > playingAnimation->endTime) {
+        animation_t = fmodf(animation_t, playingAnimation->endTime);
+    }
+}
+
+void ModelInstance::SampleAnimation(float time, AnimationSampling sampling)
+{
+    if (playingAnimation == nullptr) {
+        return;
     }
 
+    const auto *animation = playingAnimation;
+
+    // Every path below writes the node arrays directly.
     for (const auto &sampler : animation->samplers) {
-        auto *node = sampler.node;
-        assert(node != nullptr);
-        sampler.scale.GetValueAtTime(animation_t, node->scale);
-        sampler.translation.GetValueAtTime(animation_t, node->translation);
-        sampler.rotation.GetValueAtTime(animation_t, node->rotation);
+        nodes.MarkDirty(sampler.node);
+    }
+
+    if (sampling == AnimationSampling_Scan) {
+        for (const auto &sampler : animation->samplers) {
+            const uint32_t node = sampler.node;
+            assert(node < nodes.GetCount());
+            sampler.scale.GetValueAtTime(time, nodes.scales[node]);
+            sampler.translation.GetValueAtTime(time, nodes.translations[node]);
+            sampler.rotation.GetValueAtTime(time, nodes.rotations[node]);
+        }
+        return;
+    }
+
+    if (sampling == AnimationSampling_Baked && animation->baked.frameCount > 0) {
+        animation->baked.Sample(time, nodes);
+        return;
+    }
+
+    // Cursors left over from another clip are still safe to use, a stale cursor
+    // just misses the fast path once.
+    if (animationCursors.size() < animation->samplers.size()) {
+        animationCursors.resize(animation->samplers.size());
+    }
+
+    if (sampling == AnimationSampling_Compressed && !animation->compressed.samplers.empty()) {
+        animation->compressed.Sample(time, animationCursors.data(), nodes);
+        return;
+    }
+
+    if (sampling == AnimationSampling_Batch && animation->batch.frameCount > 0) {
+        animation->batch.Sample(time, nodes);
+        return;
+    }
+
+    for (uint32_t i = 0; i < animation->samplers.size(); ++i) {
+        const auto &sampler = animation->samplers[i];
+        auto &cursor = animationCursors[i];
+        const uint32_t node = sampler.node;
+        assert(node < nodes.GetCount());
+        sampler.scale.GetValueAtTime(time, nodes.scales[node], cursor.scale);
+        sampler.translation.GetValueAtTime(time, nodes.translations[node], cursor.translation);
+        sampler.rotation.GetValueAtTime(time, nodes.rotations[node], cursor.rotation);
     }
 }
 
-void Model::UpdateTransforms()
+void ModelInstance::StorePose(AnimationPose &outPose) const
 {
-    UpdateTransforms(glm::mat4(1), rootNode);
+    const auto &samplers = playingAnimation->samplers;
+    outPose.translations.resize(samplers.size());
+    outPose.scales.resize(samplers.size());
+    outPose.rotations.resize(samplers.size());
+    for (uint32_t i = 0; i < samplers.size(); ++i) {
+        const uint32_t node = samplers[i].node;
+        outPose.translations[i] = nodes.translations[node];
+        outPose.scales[i] = nodes.scales[node];
+        outPose.rotations[i] = nodes.rotations[node];
+    }
 }
 
-void Model::UpdateTransforms(glm::mat4 parentMatrix, Node &node)
+void ModelInstance::LoadPose(const AnimationPose &pose)
 {
-    node.worldMatrix = parentMatrix * node.GetLocalMatrix();
-    for (auto &child : node.children) {
-        UpdateTransforms(node.worldMatrix, child);
+    const auto &samplers = playingAnimation->samplers;
+    for (uint32_t i = 0; i < samplers.size(); ++i) {
+        const uint32_t node = samplers[i].node;
+        nodes.translations[node] = pose.translations[i];
+        nodes.scales[node] = pose.scales[i];
+        nodes.rotations[node] = pose.rotations[i];
+        nodes.MarkDirty(node);
     }
 }
 
-void Renderer::RenderNode(VkCommandBuffer commandBuffer, uint32_t frameIndex, Model &model, const Node &node)
+uint32_t ModelInstance::UpdateTransforms()
 {
-    const auto &worldMatrix = node.worldMatrix;
+    return nodes.UpdateWorldMatrices();
+}
 
-    if (node.skinIndex != UINT32_MAX) {
-        // NOTE:
-        // Assuming each skin may only be referenced by 1 node.
+uint32_t ModelInstance::GetVatPaletteBase() const
+{
+    if (animationLod != AnimationLod_Vat) {
+        return UINT32_MAX;
+    }
 
-        auto &skin = model.skins[node.skinIndex];
-        const auto &inverseBindMatrices = skin.inverseBindMatrices;
-        const auto &joints = skin.joints;
-        auto &jointMatrices = skin.jointMatrices[frameIndex];
-        auto &jointMatricesBuffer = skin.jointMatricesBuffer[frameIndex];
-        auto descriptorSet = skin.descriptorSet[frameIndex];
+    const auto &clip = asset->vatClips[playingAnimation - asset->animations.data()];
+    const uint32_t frame = glm::min((uint32_t)(animation_t * clip.sampleRate + 0.5f), clip.frameCount - 1);
+    return clip.paletteBase + frame * asset->paletteSize;
+}
+
+// Each skin goes to its paletteOffset, written straight into mapped memory.
+void ModelAsset::PackPalettes(PaletteKernel kernel, const glm::mat4 *worldMatrices, glm::vec4 *outPalettes) const
+{
+    for (const auto &skin : skins) {
+        const glm::mat4 rootNodeInverse = glm::inverse(GetSkeletonMatrix(skin, worldMatrices));
+        BuildPalette(kernel, skin.paletteFormat, rootNodeInverse, worldMatrices, skin.joints.data(),
+                     skin.inverseBindMatrices.data(), (uint32_t)skin.joints.size(), outPalettes + skin.paletteOffset);
+    }
+}
 
-        glm::mat4 rootNodeInverse = glm::inverse(worldMatrix);
+// Frustum planes straight from the rows of the matrix, depth is zero to one. Normalized so distances
+// can be compared against a radius directly.
+static void GetFrustumPlanes(const glm::mat4 &viewProjection, glm::vec4 outPlanes[6])
+{
+    const glm::mat4 rows = glm::transpose(viewProjection);
+    const glm::vec4 planes[] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1],
+                                rows[3] - rows[1], rows[2],           rows[3] - rows[2]};
+    for (uint32_t i = 0; i < 6; ++i) {
+        outPlanes[i] = planes[i] / glm::length(glm::vec3(planes[i]));
+    }
+}
 
-        for (uint32_t i = 0; i < skin.joints.size(); ++i) {
-            jointMatrices[i] = joints[i]->worldMatrix * inverseBindMatrices[i];
-            jointMatrices[i] = rootNodeInverse * jointMatrices[i];
+static bool IsSphereVisible(const glm::mat4 &viewProjection, glm::vec3 center, float radius)
+{
+    glm::vec4 planes[6];
+    GetFrustumPlanes(viewProjection, planes);
+    for (const auto &plane : planes) {
+        if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+            return false;
         }
-        memcpy(jointMatricesBuffer.data, &jointMatrices[0], jointMatrices.size() * sizeof(jointMatrices[0]));
+    }
+    return true;
+}
+
+// Bind pose bounds moved into world space by the root node's rest transform and the instance's, radius in w.
+static glm::vec4 GetBoundingSphere(const ModelAsset &asset, const glm::mat4 &transform)
+{
+    const glm::mat4 model = asset.nodes.GetCount() ? transform * asset.nodes.worldMatrices[0] : transform;
+    glm::vec3 center = glm::vec3(model * glm::vec4(asset.boundsCenter, 1.0f));
+    float scale = glm::max(glm::length(glm::vec3(model[0])),
+                           glm::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    return glm::vec4(center, asset.boundsRadius * scale);
+}
+
+// Outside as soon as the box is fully behind one plane.
+static bool IsBoxVisible(const glm::vec4 planes[6], const BoundingBox &bounds)
+{
+    const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+    const glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+    for (uint32_t i = 0; i < 6; ++i) {
+        const glm::vec3 normal = glm::vec3(planes[i]);
+        if (glm::dot(normal, center) + planes[i].w + glm::dot(glm::abs(normal), extent) < 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 1, 1, &descriptorSet,
-                                0, nullptr);
+// World space bounds of a node primitive in the draw's current pose. Skinned primitives take the union of
+// their joint boxes moved by the joint's skin matrix, VAT draws the bounds of every baked frame.
+static BoundingBox GetPrimitiveBounds(const InstanceDraw &draw, const NodePrimitive &nodePrimitive)
+{
+    const auto &asset = *draw.asset;
+    const auto &prim = asset.primitives[nodePrimitive.primitive];
+    const uint32_t node = asset.meshNodes[nodePrimitive.meshNode];
+    const uint32_t skinIndex = asset.nodes.skinIndices[node];
+    if (skinIndex == UINT32_MAX || prim.jointBoundsCount == 0) {
+        return TransformBounds(draw.transform * draw.worldMatrices[node], prim.bounds);
+    }
+    if (draw.vatPaletteBase != UINT32_MAX) {
+        return TransformBounds(draw.transform, asset.vatBounds);
     }
 
-    if (node.meshIndex != UINT32_MAX) {
-        const auto &mesh = model.meshes[node.meshIndex];
-        for (uint32_t i = 0; i < mesh.primitiveCount; ++i) {
-            auto &prim = model.primitives[mesh.primitiveOffset + i];
+    const auto &skin = asset.skins[skinIndex];
+    BoundingBox bounds;
+    for (uint32_t i = 0; i < prim.jointBoundsCount; ++i) {
+        const auto &joint = asset.jointBounds[prim.jointBoundsOffset + i];
+        const glm::mat4 skinMatrix =
+            draw.transform * draw.worldMatrices[skin.joints[joint.joint]] * skin.inverseBindMatrices[joint.joint];
+        bounds.Extend(TransformBounds(skinMatrix, joint.bounds));
+    }
+    return bounds;
+}
 
-            Constants constants = {};
-            constants.model = worldMatrix;
-            vkCmdPushConstants(commandBuffer, m_pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants),
-                               &constants);
-            vkCmdDrawIndexed(commandBuffer, prim.indexCount, 1, prim.indexOffset, 0, 0);
+// Every joint of the draw's skins in the current pose, grown by how far their vertices reach. One point per
+// joint instead of a box per joint and primitive, loose but good enough for a culling sphere.
+static BoundingBox GetSkeletonBounds(const InstanceDraw &draw)
+{
+    BoundingBox bounds;
+    for (const auto &skin : draw.asset->skins) {
+        BoundingBox joints;
+        float jointScale = 0.0f;
+        for (uint32_t joint : skin.joints) {
+            const glm::mat4 &world = draw.worldMatrices[joint];
+            joints.Extend(glm::vec3(world[3]));
+            jointScale = glm::max(jointScale, glm::max(glm::length(glm::vec3(world[0])),
+                                                       glm::max(glm::length(glm::vec3(world[1])),
+                                                                glm::length(glm::vec3(world[2])))));
         }
+        if (!joints.IsEmpty()) {
+            const glm::vec3 reach = glm::vec3(skin.jointRadius * jointScale);
+            bounds.Extend(TransformBounds(draw.transform, {joints.min - reach, joints.max + reach}));
+        }
+    }
+    return bounds;
+}
+
+// Coarsest level whose error, grown with the primitive's bounds and projected at the distance of their
+// closest point, stays under the pixel limit. Skinned bounds are loose, which only errs on the fine side.
+static uint32_t ChooseMeshLod(const Primitive &prim, const BoundingBox &bounds, glm::vec3 cameraPosition,
+                              float pixelsPerUnit, float maxPixelError)
+{
+    const float meshSize = glm::length(prim.bounds.max - prim.bounds.min);
+    const glm::vec3 offset = glm::max(glm::max(bounds.min - cameraPosition, cameraPosition - bounds.max), glm::vec3(0));
+    const float distance = glm::length(offset);
+    if (meshSize <= 0.0f || distance <= 0.0f) {
+        return 0;
     }
 
-    for (const auto &child : node.children) {
-        RenderNode(commandBuffer, frameIndex, model, child);
+    const float scale = glm::length(bounds.max - bounds.min) / meshSize * pixelsPerUnit / distance;
+    uint32_t lod = 0;
+    while (lod + 1 < prim.lodCount && prim.lods[lod + 1].error * scale <= maxPixelError) {
+        lod++;
     }
+    return lod;
 }
 
-bool Renderer::Init(GLFWwindow *window)
+void Renderer::UpdateAnimations(const AnimationUpdateInput &input, RenderStats &outStats)
 {
-    VK_CHECK(volkInitialize());
-    if (!InitVulkan(window)) {
-        return false;
+    const double updateStart = glfwGetTime();
+    const auto &settings = input.lod;
+    const auto &camera = input.camera;
+    const float tanHalfFov = tanf(camera.fov * 0.5f);
+
+    for (auto &count : outStats.animationLods) {
+        count = 0;
     }
 
-#if 0
-    // TODO: This is broken because pipeline expect some kind of skin to be bound. So either bind a default 
-    // NULL-skin or create another pipeline.
-    if (!LoadModel("./assets/DamagedHelmet.glb")) {
-        return false;
+    outStats.poseCacheHits = 0;
+    outStats.poseCacheMisses = 0;
+    outStats.nodesUpdated = 0;
+    outStats.nodeCount = 0;
+    m_poseCache.BeginFrame(input.poseCache);
+
+    m_animationQueue.clear();
+    for (uint32_t i = 0; i < m_instances.size(); ++i) {
+        auto &instance = m_instances[i];
+        const auto &asset = *instance.asset;
+        instance.pendingDt += input.dt;
+        outStats.nodeCount += instance.nodes.GetCount();
+        if (instance.framesSinceUpdate != UINT32_MAX) {
+            instance.framesSinceUpdate++;
+        }
+
+        const glm::vec4 sphere = GetBoundingSphere(asset, instance.transform);
+        glm::vec3 center = glm::vec3(sphere);
+        float radius = sphere.w;
+        float distance = glm::length(center - camera.position);
+        float size = distance > radius ? radius / (distance * tanHalfFov) : 1.0f;
+
+        AnimationLod lod = AnimationLod_Full;
+        if (settings.enabled) {
+            if (size < settings.pausedSize || !IsSphereVisible(input.viewProjection, center, radius)) {
+                lod = AnimationLod_Paused;
+            } else if (size < settings.vatSize && instance.playingAnimation && !asset.vatClips.empty()) {
+                lod = AnimationLod_Vat;
+            } else if (size < settings.quarterRateSize) {
+                lod = AnimationLod_Quarter;
+            } else if (size < settings.halfRateSize) {
+                lod = AnimationLod_Half;
+            }
+        }
+        instance.animationLod = lod;
+        outStats.animationLods[lod]++;
+
+        // The clip time is all the baked palettes need. Once the instance leaves the LOD its pose is
+        // stale, so it goes first like a new instance.
+        if (lod == AnimationLod_Vat) {
+            instance.AdvanceAnimation(instance.pendingDt);
+            instance.pendingDt = 0.0f;
+            instance.framesSinceUpdate = UINT32_MAX;
+            continue;
+        }
+
+        // Paused models still accumulate time so they resume in sync, the first update always happens so
+        // every instance has valid transforms.
+        uint32_t interval = 1u << lod;
+        if ((lod != AnimationLod_Paused && instance.framesSinceUpdate >= interval) ||
+            instance.framesSinceUpdate == UINT32_MAX) {
+            // Staleness raises the priority so models demoted by the budget can't starve, models that
+            // were never updated sort first.
+            float staleness = (float)glm::min(instance.framesSinceUpdate, 64u);
+            float priority = instance.framesSinceUpdate == UINT32_MAX ? FLT_MAX : size * staleness;
+            m_animationQueue.push_back({priority, i});
+        }
     }
-#else
-#if 1
-    if (!LoadModel("./assets/clone_trooper_dancing_clone_wars_style.glb")) {
-        printf("Error loading model\n");
+
+    std::sort(m_animationQueue.begin(), m_animationQueue.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    // Models that were never updated have no transforms yet and always go.
+    uint32_t requiredCount = 0;
+    for (const auto &[priority, instanceIndex] : m_animationQueue) {
+        requiredCount += m_instances[instanceIndex].framesSinceUpdate == UINT32_MAX ? 1 : 0;
+    }
+
+    // Over budget, whatever is left waits for the next frame. Updates may run in parallel and can't
+    // stop part way, so how many fit is decided up front from the cost of an update last frame.
+    const uint32_t threadCount = input.parallel ? m_jobs.GetThreadCount() : 1;
+    uint32_t updateCount = (uint32_t)m_animationQueue.size();
+    if (settings.enabled && m_animationUpdateMs > 0.0) {
+        uint32_t fitCount = (uint32_t)(settings.budgetMs * threadCount / m_animationUpdateMs);
+        updateCount = glm::min(updateCount, glm::max(glm::max(fitCount, 1u), requiredCount));
+    }
+    outStats.animationDemotions = (uint32_t)m_animationQueue.size() - updateCount;
+    outStats.animationUpdates = updateCount;
+    outStats.jobThreads = threadCount;
+
+    // Each update only touches its own instance, the pose cache is the one shared piece and is locked.
+    // Counters go to a slot per instance and are summed afterwards so they don't need atomics either.
+    m_updateStats.assign(updateCount, {});
+    auto update = [&](uint32_t i) {
+        auto &instance = m_instances[m_animationQueue[i].second];
+        instance.AdvanceAnimation(instance.pendingDt);
+        UpdateInstance(instance, input, m_updateStats[i]);
+        instance.pendingDt = 0.0f;
+        instance.framesSinceUpdate = 0;
+        instance.poseVersion++;
+    };
+
+    double start = glfwGetTime();
+    if (input.parallel) {
+        m_jobs.ParallelFor(updateCount, 1, update);
+    } else {
+        for (uint32_t i = 0; i < updateCount; ++i) {
+            update(i);
+        }
+    }
+    double elapsedMs = (glfwGetTime() - start) * 1000.0;
+
+    if (updateCount > 0) {
+        double updateMs = elapsedMs * threadCount / updateCount;
+        m_animationUpdateMs = m_animationUpdateMs > 0.0 ? glm::mix(m_animationUpdateMs, updateMs, 0.1) : updateMs;
+    }
+
+    for (const auto &stats : m_updateStats) {
+        outStats.poseCacheHits += stats.poseCacheHits;
+        outStats.poseCacheMisses += stats.poseCacheMisses;
+        outStats.nodesUpdated += stats.nodesUpdated;
+    }
+    outStats.poseCacheSize = (uint32_t)m_poseCache.GetSize();
+    outStats.instances = (uint32_t)m_instances.size();
+    outStats.animationMs = (glfwGetTime() - updateStart) * 1000.0;
+}
+
+void Renderer::UpdateInstance(ModelInstance &instance, const AnimationUpdateInput &input, ModelUpdateStats &outStats)
+{
+    const auto &settings = input.poseCache;
+    if (!settings.enabled || instance.playingAnimation == nullptr) {
+        instance.SampleAnimation(instance.animation_t, input.sampling);
+        outStats.nodesUpdated += instance.UpdateTransforms();
+        return;
+    }
+
+    // Instances at the same quantized time of a clip share the sampled pose.
+    PoseCacheKey key = {};
+    key.animation = instance.playingAnimation;
+    key.frame = (uint32_t)(instance.animation_t * settings.sampleRate + 0.5f);
+    key.sampling = input.sampling;
+
+    if (const auto *cached = m_poseCache.Find(key)) {
+        outStats.poseCacheHits++;
+        // Node world matrices are still needed to place the meshes.
+        instance.LoadPose(cached->pose);
+        outStats.nodesUpdated += instance.UpdateTransforms();
+        return;
+    }
+
+    outStats.poseCacheMisses++;
+    instance.SampleAnimation((float)key.frame / settings.sampleRate, input.sampling);
+    outStats.nodesUpdated += instance.UpdateTransforms();
+
+    CachedPose entry;
+    instance.StorePose(entry.pose);
+    m_poseCache.Insert(key, std::move(entry));
+}
+
+// Recording only ever looks at the draws, never at the live instances which may belong to the
+// simulation thread. Draws of the same asset are batched into instanced draw calls.
+void Renderer::BuildDraws(const FrameSnapshot *snapshot)
+{
+    m_draws.clear();
+    if (snapshot) {
+        for (const auto &instance : snapshot->instances) {
+            m_draws.push_back(
+                {instance.asset, instance.transform, instance.worldMatrices.data(), instance.vatPaletteBase});
+        }
+    } else {
+        for (const auto &instance : m_instances) {
+            m_draws.push_back({instance.asset, instance.transform, instance.nodes.worldMatrices.data(),
+                               instance.GetVatPaletteBase()});
+        }
+    }
+
+    m_batches.clear();
+    m_batchIndices[0].clear();
+    m_batchIndices[1].clear();
+    for (auto &draw : m_draws) {
+        const bool vat = draw.vatPaletteBase != UINT32_MAX;
+        auto [it, inserted] = m_batchIndices[vat].try_emplace(draw.asset, (uint32_t)m_batches.size());
+        if (inserted) {
+            m_batches.push_back({draw.asset, vat, 0, 0, 0, 0});
+        }
+        draw.batch = it->second;
+        draw.batchIndex = m_batches[draw.batch].instanceCount++;
+    }
+}
+
+// Runs once the transforms are final. Culls every node primitive against the frustum, then packs
+// every skin's palette exactly once, no matter how many nodes or passes draw it, and each visible
+// instance's per mesh node data. Only reads the world matrices it is handed and static asset data,
+// so it doesn't care which thread it runs on. Recording just issues the batches.
+bool Renderer::UpdateDraws(uint32_t frameIndex, const Camera &camera, const glm::mat4 &viewProjection)
+{
+    uint32_t paletteSize = 0;
+    uint32_t skinnedVertexCount = 0;
+    uint32_t visibilityCount = 0;
+    for (auto &draw : m_draws) {
+        // VAT instances draw straight from the baked palettes with vertex skinning.
+        const bool vat = draw.vatPaletteBase != UINT32_MAX;
+        draw.paletteBase = paletteSize;
+        paletteSize += vat ? 0 : draw.asset->paletteSize;
+        draw.skinnedVertexBase = skinnedVertexCount;
+        skinnedVertexCount += draw.asset->skinningDescriptorSet && !vat ? draw.asset->skinnedVertexCount : 0;
+        draw.visibilityBase = visibilityCount;
+        visibilityCount += (uint32_t)draw.asset->nodePrimitives.size();
+    }
+
+    // Every mesh node of a batch gets a run of instanceCount entries. Every node primitive gets a run
+    // of as many visible instance indices, one draw call per primitive covers the visible ones.
+    uint32_t instanceDataCount = 0;
+    uint32_t visibleCount = 0;
+    uint32_t nodePrimitiveCount = 0;
+    for (auto &batch : m_batches) {
+        batch.instanceBase = instanceDataCount;
+        instanceDataCount += batch.instanceCount * (uint32_t)batch.asset->meshNodes.size();
+        batch.visibleBase = visibleCount;
+        visibleCount += batch.instanceCount * (uint32_t)batch.asset->nodePrimitives.size();
+        batch.firstNodePrimitive = nodePrimitiveCount;
+        nodePrimitiveCount += (uint32_t)batch.asset->nodePrimitives.size();
+    }
+    m_primitiveVisibility.resize(visibilityCount);
+
+    // The GPU driven path packs the visible instances per draw record and mesh LOD instead.
+    if (m_gpuDriven) {
+        visibleCount = BuildDrawRecords();
+    }
+    // Only the GPU writes the visible instances in the GPU driven path, so they stay in device local memory.
+    // The ring is recreated when the mode changes.
+    if (m_visibleInstancesDeviceLocal[frameIndex] != m_gpuDriven) {
+        DestroyBuffer(m_visibleInstanceRings[frameIndex]);
+        m_visibleInstancesDeviceLocal[frameIndex] = m_gpuDriven;
+    }
+    const VkMemoryPropertyFlags visibleFlags =
+        m_gpuDriven ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                    : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!ReserveRing(m_paletteRings[frameIndex], m_paletteDescriptors[frameIndex], 0,
+                     std::max(paletteSize, 1u) * sizeof(glm::vec4)) ||
+        !ReserveRing(m_instanceRings[frameIndex], m_globalDescriptors[frameIndex], 1,
+                     std::max(instanceDataCount, 1u) * sizeof(InstanceData)) ||
+        !ReserveRing(m_visibleInstanceRings[frameIndex], m_globalDescriptors[frameIndex], 3,
+                     std::max(visibleCount, 1u) * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     visibleFlags)) {
         return false;
     }
-#else
-    if (!LoadModel("./assets/RiggedFigure.glb")) {
+    if (m_skinningMode == SkinningMode_Compute && !ReserveSkinnedVertices(skinnedVertexCount)) {
         return false;
     }
-#endif
 
-    Model &model = m_models.back();
-    model.playingAnimation = &model.animations[0];
-#endif
+    // The records and counts only grow with the batches, the instances just add a sphere each.
+    CullInstance *cullInstances = nullptr;
+    if (m_gpuDriven) {
+        const uint32_t countCount = (uint32_t)(m_drawGroups.size() + m_drawRecords.size() * MAX_MESH_LODS);
+        if (!ReserveRing(m_cullInstanceRings[frameIndex], m_cullDescriptors[frameIndex], 0,
+                         std::max((uint32_t)m_draws.size(), 1u) * sizeof(CullInstance)) ||
+            !ReserveRing(m_cullBatchRings[frameIndex], m_cullDescriptors[frameIndex], 1,
+                         std::max((uint32_t)m_batches.size(), 1u) * sizeof(CullBatch)) ||
+            !ReserveRing(m_drawRecordRings[frameIndex], m_cullDescriptors[frameIndex], 2,
+                         std::max((uint32_t)m_drawRecords.size(), 1u) * sizeof(DrawRecord)) ||
+            !ReserveRing(m_drawCountRings[frameIndex], m_cullDescriptors[frameIndex], 3,
+                         std::max(countCount, 1u) * sizeof(uint32_t), indirectUsage,
+                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ||
+            !ReserveRing(m_drawCommandRings[frameIndex], m_cullDescriptors[frameIndex], 4,
+                         std::max(m_drawCommandCount, 1u) * sizeof(VkDrawIndexedIndirectCommand),
+                         indirectUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+            return false;
+        }
+
+        CullBatch *cullBatches = (CullBatch *)m_cullBatchRings[frameIndex].data;
+        for (uint32_t i = 0; i < m_batches.size(); ++i) {
+            const auto &batch = m_batches[i];
+            cullBatches[i] = {batch.instanceBase, batch.instanceCount, batch.firstNodePrimitive,
+                              (uint32_t)batch.asset->nodePrimitives.size()};
+        }
+        if (!m_drawRecords.empty()) {
+            memcpy(m_drawRecordRings[frameIndex].data, m_drawRecords.data(),
+                   m_drawRecords.size() * sizeof(DrawRecord));
+        }
+        cullInstances = (CullInstance *)m_cullInstanceRings[frameIndex].data;
+    }
+
+    glm::vec4 frustumPlanes[6];
+    GetFrustumPlanes(viewProjection, frustumPlanes);
+    const float pixelsPerUnit = m_swapchainExtent.height * 0.5f / tanf(camera.fov * 0.5f);
+
+    glm::vec4 *palettes = (glm::vec4 *)m_paletteRings[frameIndex].data;
+    InstanceData *instanceData = (InstanceData *)m_instanceRings[frameIndex].data;
+    auto update = [&](uint32_t drawIndex) {
+        auto &draw = m_draws[drawIndex];
+        const auto &asset = *draw.asset;
+
+        // The GPU driven path culls on its own and only takes one sphere, skinned primitives in the current
+        // pose are covered by the skeleton bounds instead of their joint boxes.
+        BoundingBox drawBounds;
+        bool skeletonBounds = false;
+        uint8_t *visibility = m_primitiveVisibility.data() + draw.visibilityBase;
+        draw.visible = false;
+        for (uint32_t i = 0; i < asset.nodePrimitives.size(); ++i) {
+            const auto &nodePrimitive = asset.nodePrimitives[i];
+            const auto &prim = asset.primitives[nodePrimitive.primitive];
+            if (m_gpuDriven) {
+                const uint32_t skinIndex = asset.nodes.skinIndices[asset.meshNodes[nodePrimitive.meshNode]];
+                if (skinIndex != UINT32_MAX && prim.jointBoundsCount > 0 && draw.vatPaletteBase == UINT32_MAX) {
+                    skeletonBounds = true;
+                } else {
+                    drawBounds.Extend(GetPrimitiveBounds(draw, nodePrimitive));
+                }
+                visibility[i] = 1;
+            } else {
+                const BoundingBox bounds = GetPrimitiveBounds(draw, nodePrimitive);
+                if (IsBoxVisible(frustumPlanes, bounds)) {
+                    visibility[i] =
+                        1 + ChooseMeshLod(prim, bounds, camera.position, pixelsPerUnit, m_meshLodPixelError);
+                } else {
+                    visibility[i] = 0;
+                }
+            }
+            draw.visible |= visibility[i] != 0;
+        }
+        if (cullInstances) {
+            if (skeletonBounds) {
+                drawBounds.Extend(GetSkeletonBounds(draw));
+            }
+            const glm::vec3 center = (drawBounds.min + drawBounds.max) * 0.5f;
+            const float radius = glm::length(drawBounds.max - drawBounds.min) * 0.5f;
+            const float lodScale = glm::max(glm::length(glm::vec3(draw.transform[0])),
+                                            glm::max(glm::length(glm::vec3(draw.transform[1])),
+                                                     glm::length(glm::vec3(draw.transform[2]))));
+            cullInstances[drawIndex] = {glm::vec4(center, radius), draw.batch, draw.batchIndex, lodScale};
+        }
+        if (!draw.visible) {
+            return;
+        }
+
+        const bool vat = draw.vatPaletteBase != UINT32_MAX;
+        if (!vat) {
+            asset.PackPalettes(m_paletteKernel, draw.worldMatrices, palettes + draw.paletteBase);
+        }
+
+        const auto &batch = m_batches[draw.batch];
+        for (uint32_t i = 0; i < asset.meshNodes.size(); ++i) {
+            const uint32_t node = asset.meshNodes[i];
+            const uint32_t skinIndex = asset.nodes.skinIndices[node];
+
+            InstanceData data = {};
+            data.model = draw.transform * draw.worldMatrices[node];
+            data.skinnedVertexBase = draw.skinnedVertexBase + asset.skinnedVertexBases[i];
+            data.positionQuantization = asset.positionQuantization;
+            if (skinIndex != UINT32_MAX) {
+                const auto &skin = asset.skins[skinIndex];
+                const glm::mat4 *skeletonMatrices = vat ? asset.nodes.worldMatrices.data() : draw.worldMatrices;
+                data.model = draw.transform * GetSkeletonMatrix(skin, skeletonMatrices);
+                data.paletteBase = (vat ? draw.vatPaletteBase : draw.paletteBase) + skin.paletteOffset;
+            }
+            instanceData[batch.instanceBase + i * batch.instanceCount + draw.batchIndex] = data;
+        }
+    };
+    if (m_parallelUpdate) {
+        m_jobs.ParallelFor((uint32_t)m_draws.size(), 16, update);
+    } else {
+        for (uint32_t i = 0; i < m_draws.size(); ++i) {
+            update(i);
+        }
+    }
+
+    // Appending to the shared runs is left to one thread, it is a few bytes per node primitive. Counting
+    // first lets every node primitive's run be sorted by mesh LOD.
+    m_stats.instancesCulled = 0;
+    m_stats.primitivesDrawn = 0;
+    m_stats.primitivesCulled = 0;
+    for (auto &count : m_stats.meshLods) {
+        count = 0;
+    }
+    if (!m_gpuDriven) {
+        m_primitiveCounts.assign(nodePrimitiveCount * MAX_MESH_LODS, 0);
+        for (const auto &draw : m_draws) {
+            const auto &nodePrimitives = draw.asset->nodePrimitives;
+            if (!draw.visible) {
+                m_stats.instancesCulled++;
+                m_stats.primitivesCulled += (uint32_t)nodePrimitives.size();
+                continue;
+            }
+
+            const auto &batch = m_batches[draw.batch];
+            const uint8_t *visibility = m_primitiveVisibility.data() + draw.visibilityBase;
+            for (uint32_t i = 0; i < nodePrimitives.size(); ++i) {
+                if (!visibility[i]) {
+                    m_stats.primitivesCulled++;
+                    continue;
+                }
+                m_primitiveCounts[(batch.firstNodePrimitive + i) * MAX_MESH_LODS + visibility[i] - 1]++;
+                m_stats.meshLods[visibility[i] - 1]++;
+                m_stats.primitivesDrawn++;
+            }
+        }
+
+        m_primitiveCursors.resize(m_primitiveCounts.size());
+        for (const auto &batch : m_batches) {
+            for (uint32_t i = 0; i < batch.asset->nodePrimitives.size(); ++i) {
+                const uint32_t first = (batch.firstNodePrimitive + i) * MAX_MESH_LODS;
+                uint32_t cursor = batch.visibleBase + i * batch.instanceCount;
+                for (uint32_t lod = 0; lod < MAX_MESH_LODS; ++lod) {
+                    m_primitiveCursors[first + lod] = cursor;
+                    cursor += m_primitiveCounts[first + lod];
+                }
+            }
+        }
+
+        uint32_t *visibleInstances = (uint32_t *)m_visibleInstanceRings[frameIndex].data;
+        for (const auto &draw : m_draws) {
+            if (!draw.visible) {
+                continue;
+            }
+
+            const auto &nodePrimitives = draw.asset->nodePrimitives;
+            const auto &batch = m_batches[draw.batch];
+            const uint8_t *visibility = m_primitiveVisibility.data() + draw.visibilityBase;
+            for (uint32_t i = 0; i < nodePrimitives.size(); ++i) {
+                if (visibility[i]) {
+                    const uint32_t slot = (batch.firstNodePrimitive + i) * MAX_MESH_LODS + visibility[i] - 1;
+                    uint32_t &cursor = m_primitiveCursors[slot];
+                    const uint32_t runBase = batch.instanceBase + nodePrimitives[i].meshNode * batch.instanceCount;
+                    visibleInstances[cursor++] = runBase + draw.batchIndex;
+                }
+            }
+        }
+    }
+
+    m_stats.paletteBytes = paletteSize * sizeof(glm::vec4);
+    return true;
+}
+
+uint32_t Renderer::SkinInstance(VkCommandBuffer commandBuffer, const InstanceDraw &draw)
+{
+    const auto &asset = *draw.asset;
+    if (!asset.skinningDescriptorSet || draw.vatPaletteBase != UINT32_MAX || !draw.visible) {
+        return 0;
+    }
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_skinningPipelineLayout, 0, 1,
+                            &asset.skinningDescriptorSet, 0, nullptr);
+
+    uint32_t vertexCount = 0;
+    for (uint32_t n = 0; n < asset.meshNodes.size(); ++n) {
+        const uint32_t node = asset.meshNodes[n];
+        const uint32_t skinIndex = asset.nodes.skinIndices[node];
+        if (skinIndex == UINT32_MAX) {
+            continue;
+        }
+
+        const auto &skin = asset.skins[skinIndex];
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_skinningPipelines[skin.paletteFormat]);
+
+        // Every node writes its own range, so dispatches of nodes sharing a mesh don't race.
+        const auto &mesh = asset.meshes[asset.nodes.meshIndices[node]];
+        for (uint32_t i = 0; i < mesh.primitiveCount; ++i) {
+            const auto &prim = asset.primitives[mesh.primitiveOffset + i];
+
+            SkinningConstants constants = {};
+            constants.vertexOffset = prim.vertexOffset;
+            constants.vertexCount = prim.vertexCount;
+            constants.paletteBase = draw.paletteBase + skin.paletteOffset;
+            constants.outputBase = draw.skinnedVertexBase + asset.skinnedVertexBases[n];
+            constants.positionQuantization = asset.positionQuantization;
+            vkCmdPushConstants(commandBuffer, m_skinningPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                               sizeof(constants), &constants);
+            vkCmdDispatch(commandBuffer, (prim.vertexCount + 63) / 64, 1, 1);
+            vertexCount += prim.vertexCount;
+        }
+    }
+
+    return vertexCount;
+}
+
+// Compute skinned meshes are already in skeleton space and draw like static ones.
+VkPipeline Renderer::ChoosePipeline(const DrawBatch &batch, uint32_t node) const
+{
+    const auto &asset = *batch.asset;
+    const uint32_t skinIndex = asset.nodes.skinIndices[node];
+    const bool computeSkinned = m_skinningMode == SkinningMode_Compute && asset.skinningDescriptorSet && !batch.vat;
+    if (skinIndex != UINT32_MAX && computeSkinned) {
+        return m_staticPipeline;
+    }
+
+    const PaletteFormat format = skinIndex != UINT32_MAX ? asset.skins[skinIndex].paletteFormat : PaletteFormat_Mat4;
+    return m_pipelines[format];
+}
+
+// Returns the number of draw calls.
+uint32_t Renderer::RenderBatch(VkCommandBuffer commandBuffer, const DrawBatch &batch)
+{
+    const auto &asset = *batch.asset;
+    uint32_t drawCount = 0;
+    VkPipeline boundPipeline = nullptr;
+    VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+    bool vertexBufferBound = false;
+    for (uint32_t i = 0; i < asset.nodePrimitives.size(); ++i) {
+        const uint32_t *counts = &m_primitiveCounts[(batch.firstNodePrimitive + i) * MAX_MESH_LODS];
+        uint32_t visibleCount = 0;
+        for (uint32_t lod = 0; lod < MAX_MESH_LODS; ++lod) {
+            visibleCount += counts[lod];
+        }
+        if (visibleCount == 0) {
+            continue;
+        }
+
+        const auto &nodePrimitive = asset.nodePrimitives[i];
+        const uint32_t node = asset.meshNodes[nodePrimitive.meshNode];
+        const VkPipeline pipeline = ChoosePipeline(batch, node);
+        const bool drawSkinned = pipeline == m_staticPipeline;
+        if (pipeline != boundPipeline) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            boundPipeline = pipeline;
+        }
+        if (!drawSkinned && !vertexBufferBound) {
+            const VkDeviceSize vertexBufferOffset = 0;
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &asset.vertexBuffer.buffer, &vertexBufferOffset);
+            vertexBufferBound = true;
+        }
+
+        const auto &prim = asset.primitives[nodePrimitive.primitive];
+        if (prim.indexType != boundIndexType) {
+            const VkDeviceSize indexBufferOffset = prim.indexType == VK_INDEX_TYPE_UINT16 ? 0 : asset.wideIndexOffset;
+            vkCmdBindIndexBuffer(commandBuffer, asset.indexBuffer.buffer, indexBufferOffset, prim.indexType);
+            boundIndexType = prim.indexType;
+        }
+
+        uint32_t firstInstance = batch.visibleBase + i * batch.instanceCount;
+        for (uint32_t lod = 0; lod < prim.lodCount; ++lod) {
+            if (counts[lod]) {
+                const auto &meshLod = prim.lods[lod];
+                vkCmdDrawIndexed(commandBuffer, meshLod.indexCount, counts[lod], meshLod.indexOffset,
+                                 (int32_t)prim.vertexOffset, firstInstance);
+                firstInstance += counts[lod];
+                drawCount++;
+            }
+        }
+    }
+    return drawCount;
+}
+
+// Records are built per batch and node primitive, in the same order as the node primitives. Every group
+// of a batch's records sharing a pipeline and index type gets one command slot per record and mesh LOD,
+// the culling pass packs the non empty ones to the front. Returns how many visible instance indices the
+// records need.
+uint32_t Renderer::BuildDrawRecords()
+{
+    m_drawRecords.clear();
+    m_drawGroups.clear();
+    uint32_t visibleCount = 0;
+    for (uint32_t batchIndex = 0; batchIndex < m_batches.size(); ++batchIndex) {
+        const auto &batch = m_batches[batchIndex];
+        const auto &asset = *batch.asset;
+        const uint32_t firstGroup = (uint32_t)m_drawGroups.size();
+        for (const auto &nodePrimitive : asset.nodePrimitives) {
+            const VkPipeline pipeline = ChoosePipeline(batch, asset.meshNodes[nodePrimitive.meshNode]);
+            const auto &prim = asset.primitives[nodePrimitive.primitive];
+            uint32_t group = firstGroup;
+            while (group < m_drawGroups.size() &&
+                   (m_drawGroups[group].pipeline != pipeline || m_drawGroups[group].indexType != prim.indexType)) {
+                group++;
+            }
+            if (group == m_drawGroups.size()) {
+                m_drawGroups.push_back({batchIndex, pipeline, pipeline == m_staticPipeline, prim.indexType, 0, 0});
+            }
+
+            DrawRecord record = {};
+            for (uint32_t lod = 0; lod < prim.lodCount; ++lod) {
+                record.firstIndex[lod] = prim.lods[lod].indexOffset;
+                record.indexCount[lod] = prim.lods[lod].indexCount;
+                record.error[lod] = prim.lods[lod].error;
+            }
+            record.lodCount = prim.lodCount;
+            record.group = group;
+            record.instanceRun = batch.instanceBase + nodePrimitive.meshNode * batch.instanceCount;
+            record.visibleBase = visibleCount;
+            record.instanceCount = batch.instanceCount;
+            record.vertexOffset = (int32_t)prim.vertexOffset;
+            m_drawRecords.push_back(record);
+            m_drawGroups[group].commandCount += prim.lodCount;
+            visibleCount += batch.instanceCount * prim.lodCount;
+        }
+    }
+
+    m_drawCommandCount = 0;
+    for (auto &group : m_drawGroups) {
+        group.firstCommand = m_drawCommandCount;
+        m_drawCommandCount += group.commandCount;
+    }
+    for (auto &record : m_drawRecords) {
+        record.firstCommand = m_drawGroups[record.group].firstCommand;
+    }
+    return visibleCount;
+}
+
+// Clears the counts, culls every instance against the frustum, appends the visible ones to their records
+// at the mesh LOD they pick and turns every non empty record LOD into an indirect command.
+void Renderer::CullInstances(VkCommandBuffer commandBuffer, uint32_t frameIndex, const Camera &camera,
+                             const glm::mat4 &viewProjection)
+{
+    if (m_drawRecords.empty()) {
+        return;
+    }
+
+    const VkDeviceSize countSize = (m_drawGroups.size() + m_drawRecords.size() * MAX_MESH_LODS) * sizeof(uint32_t);
+    vkCmdFillBuffer(commandBuffer, m_drawCountRings[frameIndex].buffer, 0, countSize, 0);
+    // Without indirect count every slot of a group is drawn, the ones left over must be empty.
+    if (!m_drawIndirectCount) {
+        vkCmdFillBuffer(commandBuffer, m_drawCommandRings[frameIndex].buffer, 0,
+                        m_drawCommandCount * sizeof(VkDrawIndexedIndirectCommand), 0);
+    }
+    PipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    CullConstants constants = {};
+    GetFrustumPlanes(viewProjection, constants.frustumPlanes);
+    constants.cameraPosition = camera.position;
+    constants.pixelsPerUnit = m_swapchainExtent.height * 0.5f / tanf(camera.fov * 0.5f);
+    constants.maxPixelError = m_meshLodPixelError;
+    constants.instanceCount = (uint32_t)m_draws.size();
+    constants.recordCount = (uint32_t)m_drawRecords.size();
+    constants.groupCount = (uint32_t)m_drawGroups.size();
+
+    const VkDescriptorSet descriptorSets[] = {m_globalDescriptors[frameIndex], m_cullDescriptors[frameIndex]};
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipelineLayout, 0,
+                            ARRAY_COUNT(descriptorSets), descriptorSets, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, m_cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                       &constants);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_cullPipeline);
+    vkCmdDispatch(commandBuffer, (constants.instanceCount + 63) / 64, 1, 1);
+
+    PipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_drawCommandPipeline);
+    vkCmdDispatch(commandBuffer, (constants.recordCount + 63) / 64, 1, 1);
+
+    PipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+                    VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+// Returns the number of draw calls, one per group unless the device can't draw several indirect
+// commands at once.
+uint32_t Renderer::RenderGroup(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t groupIndex)
+{
+    const auto &group = m_drawGroups[groupIndex];
+    const auto &batch = m_batches[group.batch];
+    const auto &asset = *batch.asset;
+
+    const VkDescriptorSet palettes = batch.vat ? asset.vatDescriptorSet : m_paletteDescriptors[frameIndex];
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 1, 1, &palettes, 0,
+                            nullptr);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, group.pipeline);
+    const VkDeviceSize indexBufferOffset = group.indexType == VK_INDEX_TYPE_UINT16 ? 0 : asset.wideIndexOffset;
+    vkCmdBindIndexBuffer(commandBuffer, asset.indexBuffer.buffer, indexBufferOffset, group.indexType);
+    if (!group.preSkinned) {
+        const VkDeviceSize vertexBufferOffset = 0;
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, &asset.vertexBuffer.buffer, &vertexBufferOffset);
+    }
+
+    const VkBuffer commands = m_drawCommandRings[frameIndex].buffer;
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    const VkDeviceSize offset = group.firstCommand * stride;
+    if (m_drawIndirectCount) {
+        const VkDeviceSize countOffset = groupIndex * sizeof(uint32_t);
+        vkCmdDrawIndexedIndirectCount(commandBuffer, commands, offset, m_drawCountRings[frameIndex].buffer,
+                                      countOffset, group.commandCount, stride);
+        return 1;
+    }
+    if (m_multiDrawIndirect) {
+        vkCmdDrawIndexedIndirect(commandBuffer, commands, offset, group.commandCount, stride);
+        return 1;
+    }
+    for (uint32_t i = 0; i < group.commandCount; ++i) {
+        vkCmdDrawIndexedIndirect(commandBuffer, commands, offset + i * stride, 1, stride);
+    }
+    return group.commandCount;
+}
+
+bool Renderer::Init(GLFWwindow *window)
+{
+    VK_CHECK(volkInitialize());
+    if (!m_jobs.Init()) {
+        return false;
+    }
+    if (!InitVulkan(window)) {
+        return false;
+    }
 
     return true;
 }
@@ -1084,13 +2859,78 @@ bool Renderer::Render(const Camera &camera, GLFWwindow *window, double dt)
     m_nextFrameIndex = (m_nextFrameIndex + 1) % MAX_FRAMES_IN_FLIGHT;
     VK_CHECK(vkWaitForFences(m_device, 1, &m_commandBufferReady[frameIndex], VK_TRUE, ~0ull));
     VK_CHECK(vkResetFences(m_device, 1, &m_commandBufferReady[frameIndex]));
+    RetireUploads();
+
+    // GPU time of the last frame recorded into this slot.
+    double gpuMs = 0.0;
+    if (m_timestampsWritten[frameIndex]) {
+        uint64_t timestamps[2] = {};
+        if (vkGetQueryPoolResults(m_device, m_queryPool, frameIndex * 2, 2, sizeof(timestamps), timestamps,
+                                  sizeof(timestamps[0]), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            gpuMs = (double)(timestamps[1] - timestamps[0]) * m_timestampPeriod / 1e6;
+        }
+    }
 
     uint32_t imageIndex = ~0u;
     VK_CHECK(vkAcquireNextImageKHR(m_device, m_swapchain, ~0ull, m_imageReady[frameIndex], nullptr, &imageIndex));
 
-    for (auto &model : m_models) {
-        model.UpdateAnimations((float)dt);
-        model.UpdateTransforms();
+    float width = (float)m_swapchainExtent.width;
+    float height = (float)m_swapchainExtent.height;
+
+    float aspectRatio = width / height;
+    glm::mat4 projection = glm::perspective(camera.fov, aspectRatio, camera.near, camera.far);
+    if (camera.flipY)
+        projection[1][1] *= -1;
+    glm::mat4 view = glm::lookAt(camera.position, camera.target, camera.up);
+    glm::mat4 viewProjection = projection * view;
+
+    AnimationUpdateInput input = {};
+    input.camera = camera;
+    input.viewProjection = viewProjection;
+    input.dt = (float)dt;
+    input.sampling = m_animationSampling;
+    input.lod = m_animationLodSettings;
+    input.poseCache = m_poseCacheSettings;
+    input.parallel = m_parallelUpdate;
+
+    if (m_pipelined != m_simulationThread.joinable()) {
+        if (m_pipelined) {
+            StartSimulation(input);
+        } else {
+            StopSimulation();
+        }
+    }
+
+    const FrameSnapshot *snapshot = nullptr;
+    if (m_simulationThread.joinable()) {
+        // Draw the newest finished frame, or the previous one again if the simulation fell behind.
+        // Only the very first frame has to wait.
+        while (!m_snapshots.Acquire() && !m_hasSnapshot) {
+            std::this_thread::yield();
+        }
+        m_hasSnapshot = true;
+        snapshot = &m_snapshots.GetReadSlot();
+        m_stats = snapshot->stats;
+
+        // Hand over the next frame while this one is recorded. Time adds up if the simulation
+        // hasn't picked up the last request yet.
+        {
+            std::lock_guard<std::mutex> lock(m_simulationInputMutex);
+            input.dt += m_simulationInput.dt;
+            m_simulationInput = input;
+        }
+        m_simulationRequest++;
+        m_simulationRequest.notify_one();
+    } else {
+        UpdateAnimations(input, m_stats);
+    }
+    m_stats.gpuMs = gpuMs;
+    m_stats.skinnedVertices = 0;
+    m_stats.drawCalls = 0;
+
+    BuildDraws(snapshot);
+    if (!UpdateDraws(frameIndex, camera, viewProjection)) {
+        return false;
     }
 
     VkCommandBuffer commandBuffer = m_commandBuffers[frameIndex];
@@ -1099,6 +2939,31 @@ bool Renderer::Render(const Camera &camera, GLFWwindow *window, double dt)
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
     {
+        m_waitSemaphores.assign(1, m_imageReady[frameIndex]);
+        m_waitStages.assign(1, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+        AcquireUploads(commandBuffer);
+
+        vkCmdResetQueryPool(commandBuffer, m_queryPool, frameIndex * 2, 2);
+        vkCmdWriteTimestamp2KHR(commandBuffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, m_queryPool, frameIndex * 2);
+
+        if (m_skinningMode == SkinningMode_Compute) {
+            // The previous frame may still be drawing from the skinned buffers.
+            PipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_NONE,
+                            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_NONE);
+
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_skinningPipelineLayout, 1, 1,
+                                    &m_paletteDescriptors[frameIndex], 0, nullptr);
+            for (const auto &draw : m_draws) {
+                m_stats.skinnedVertices += SkinInstance(commandBuffer, draw);
+            }
+
+            PipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                            VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+        }
+
+        if (m_gpuDriven) {
+            CullInstances(commandBuffer, frameIndex, camera, viewProjection);
+        }
 
         TransitionImageLayout(commandBuffer, m_swapchainImages[imageIndex], VK_IMAGE_LAYOUT_UNDEFINED,
                               VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
@@ -1137,11 +3002,6 @@ bool Renderer::Render(const Camera &camera, GLFWwindow *window, double dt)
 
         vkCmdBeginRenderingKHR(commandBuffer, &renderingInfo);
         {
-            float width = (float)m_swapchainExtent.width;
-            float height = (float)m_swapchainExtent.height;
-
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline);
-
             VkRect2D scissor = {};
             scissor.extent = m_swapchainExtent;
             VkViewport viewport = {};
@@ -1155,40 +3015,46 @@ bool Renderer::Render(const Camera &camera, GLFWwindow *window, double dt)
             vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
             vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-            float aspectRatio = width / height;
-            glm::mat4 projection = glm::perspective(camera.fov, aspectRatio, camera.near, camera.far);
-            if (camera.flipY)
-                projection[1][1] *= -1;
-            glm::mat4 view = glm::lookAt(camera.position, camera.target, camera.up);
-
             GlobalUniforms globalUniforms = {};
-            globalUniforms.viewProjection = projection * view;
+            globalUniforms.viewProjection = viewProjection;
             ;
             memcpy(m_globalUniformBuffers[frameIndex].data, &globalUniforms, sizeof(globalUniforms));
             vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1,
                                     &m_globalDescriptors[frameIndex], 0, nullptr);
 
-            for (auto &model : m_models) {
-                VkDeviceSize vertexBufferOffset = 0;
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, &model.vertexBuffer.buffer, &vertexBufferOffset);
-                vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
-                RenderNode(commandBuffer, frameIndex, model, model.rootNode);
+            for (uint32_t pass = 0; pass < m_passCount; ++pass) {
+                if (m_gpuDriven) {
+                    for (uint32_t group = 0; group < m_drawGroups.size(); ++group) {
+                        m_stats.drawCalls += RenderGroup(commandBuffer, frameIndex, group);
+                    }
+                    continue;
+                }
+
+                for (const auto &batch : m_batches) {
+                    const VkDescriptorSet palettes =
+                        batch.vat ? batch.asset->vatDescriptorSet : m_paletteDescriptors[frameIndex];
+                    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 1, 1,
+                                            &palettes, 0, nullptr);
+                    m_stats.drawCalls += RenderBatch(commandBuffer, batch);
+                }
             }
         }
         vkCmdEndRenderingKHR(commandBuffer);
 
         TransitionImageLayout(commandBuffer, m_swapchainImages[imageIndex], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
                               VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+
+        vkCmdWriteTimestamp2KHR(commandBuffer, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, m_queryPool,
+                                frameIndex * 2 + 1);
+        m_timestampsWritten[frameIndex] = true;
     }
     vkEndCommandBuffer(commandBuffer);
 
-    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_imageReady[frameIndex];
-    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.waitSemaphoreCount = (uint32_t)m_waitSemaphores.size();
+    submitInfo.pWaitSemaphores = m_waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = m_waitStages.data();
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = &commandBuffer;
     submitInfo.signalSemaphoreCount = 1;
@@ -1203,10 +3069,126 @@ bool Renderer::Render(const Camera &camera, GLFWwindow *window, double dt)
     presentInfo.pSwapchains = &m_swapchain;
     presentInfo.pImageIndices = &imageIndex;
     VK_CHECK(vkQueuePresentKHR(m_presentQueue, &presentInfo));
+    m_frameCount++;
 
     return true;
 }
 
+void Renderer::StartSimulation(const AnimationUpdateInput &input)
+{
+    // The first request simulates a frame right away so there is something to draw, this frame's
+    // time goes to the next one.
+    m_hasSnapshot = false;
+    m_simulationInput = input;
+    m_simulationInput.dt = 0.0f;
+    m_simulationRunning = true;
+    m_simulationRequest++;
+    m_simulationThread = std::thread(&Renderer::SimulationMain, this);
+}
+
+void Renderer::StopSimulation()
+{
+    m_simulationRunning = false;
+    m_simulationRequest++;
+    m_simulationRequest.notify_one();
+    m_simulationThread.join();
+}
+
+void Renderer::SimulationMain()
+{
+    uint64_t handled = 0;
+    while (true) {
+        m_simulationRequest.wait(handled);
+        handled = m_simulationRequest.load();
+        if (!m_simulationRunning) {
+            return;
+        }
+
+        AnimationUpdateInput input;
+        {
+            std::lock_guard<std::mutex> lock(m_simulationInputMutex);
+            input = m_simulationInput;
+            m_simulationInput.dt = 0.0f;
+        }
+
+        auto &snapshot = m_snapshots.GetWriteSlot();
+        {
+            std::lock_guard<std::mutex> lock(m_instancesMutex);
+            UpdateAnimations(input, snapshot.stats);
+            WriteSnapshot(snapshot);
+        }
+        m_snapshots.Publish();
+    }
+}
+
+void Renderer::WriteSnapshot(FrameSnapshot &outSnapshot)
+{
+    outSnapshot.instances.resize(m_instances.size());
+    for (uint32_t i = 0; i < m_instances.size(); ++i) {
+        const auto &instance = m_instances[i];
+        auto &snapshot = outSnapshot.instances[i];
+        snapshot.asset = instance.asset;
+        snapshot.transform = instance.transform;
+        snapshot.vatPaletteBase = instance.GetVatPaletteBase();
+        // Slots are reused, skip the copy if this one already holds the pose. Destroying instances
+        // shuffles them around, so the id has to match too.
+        if (snapshot.id == instance.id && snapshot.poseVersion == instance.poseVersion) {
+            continue;
+        }
+
+        snapshot.id = instance.id;
+        snapshot.poseVersion = instance.poseVersion;
+        snapshot.worldMatrices = instance.nodes.worldMatrices;
+    }
+}
+
+uint32_t Renderer::CreateModelInstance(const ModelAsset *asset, const glm::mat4 &transform, uint32_t animation)
+{
+    std::lock_guard<std::mutex> lock(m_instancesMutex);
+    const uint32_t id = m_nextInstanceId++;
+    m_instanceIndices[id] = (uint32_t)m_instances.size();
+
+    auto &instance = m_instances.emplace_back();
+    instance.asset = asset;
+    instance.id = id;
+    instance.transform = transform;
+    instance.nodes = asset->nodes;
+    if (animation < asset->animations.size()) {
+        instance.playingAnimation = &asset->animations[animation];
+    }
+    return id;
+}
+
+void Renderer::DestroyModelInstance(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_instancesMutex);
+    auto it = m_instanceIndices.find(id);
+    if (it == m_instanceIndices.end()) {
+        return;
+    }
+
+    const uint32_t index = it->second;
+    m_instanceIndices.erase(it);
+    if (index != m_instances.size() - 1) {
+        m_instances[index] = std::move(m_instances.back());
+        m_instanceIndices[m_instances[index].id] = index;
+    }
+    m_instances.pop_back();
+}
+
+void Renderer::SetModelInstanceTransform(uint32_t id, const glm::mat4 &transform)
+{
+    std::lock_guard<std::mutex> lock(m_instancesMutex);
+    auto it = m_instanceIndices.find(id);
+    if (it != m_instanceIndices.end()) {
+        m_instances[it->second].transform = transform;
+    }
+}
+
 void Renderer::Shutdown()
 {
+    if (m_simulationThread.joinable()) {
+        StopSimulation();
+    }
+    m_jobs.Shutdown();
 }
@@ -7,14 +7,26 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <float.h>
 #include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <vulkan/vk_enum_string_helper.h>
 
+#include "allocator.h"
+#include "animation.h"
+#include "jobs.h"
+#include "palette.h"
+
 #define LOG_ERROR(message, ...) fprintf(stderr, "ERROR: " message "\n" ,##__VA_ARGS__)
 
 #define MAX_FRAMES_IN_FLIGHT 3
+#define MAX_MESH_LODS 4
 #define ARRAY_COUNT(array) (sizeof(array) / sizeof(array[0]))
 #define VK_CHECK(call)                                                                                                 \
     do {                                                                                                               \
@@ -44,6 +56,7 @@ static const char *deviceExtensions[] = {
     VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
 };
 
+// As loaded, only used while processing an asset.
 struct Vertex
 {
     glm::vec3 position;
@@ -53,9 +66,100 @@ struct Vertex
     glm::vec4 weights;
 };
 
-struct Constants
+// What vertex buffers hold, 24 bytes. Positions are unorm16 within the asset's bounds, see
+// ModelAsset::positionQuantization, normals are octahedral snorm16 and texture coordinates half
+// floats. Skins can have at most 256 joints.
+struct PackedVertex
+{
+    uint16_t position[4];
+    int16_t normal[2];
+    uint32_t texCoord;
+    uint8_t joints[4];
+    uint8_t weights[4];
+};
+
+// Output of the compute skinning pass, every instance gets a copy laid out parallel to its asset's vertex buffer.
+struct SkinnedVertex
+{
+    glm::vec4 position;
+    glm::vec4 normal;
+};
+
+// One per instance and mesh node, the vertex shaders index it with gl_InstanceIndex. Matches the
+// std430 layout in instance.glsl.
+struct InstanceData
 {
     glm::mat4 model;
+    // The asset's ModelAsset::positionQuantization.
+    glm::vec4 positionQuantization;
+    // vec4 index of the skin's palette in this frame's palette ring.
+    uint32_t paletteBase;
+    // Where the mesh node's compute skinned vertices start, see ModelAsset::skinnedVertexBases.
+    uint32_t skinnedVertexBase;
+    uint32_t padding[2];
+};
+
+struct SkinningConstants
+{
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t paletteBase;
+    // Where the node's copy of the vertices starts in the skinned vertex buffer, added to vertex indices.
+    uint32_t outputBase;
+    glm::vec4 positionQuantization;
+};
+
+// One per instance, the culling pass tests it and appends the visible ones to their batch's records at the
+// mesh LOD each one picks. Matches cull.glsl.
+struct CullInstance
+{
+    // World space bounding sphere, radius in w.
+    glm::vec4 sphere;
+    uint32_t batch;
+    uint32_t batchIndex;
+    // Largest axis scale of the instance transform, mesh LOD errors are in mesh units.
+    float lodScale;
+    uint32_t padding;
+};
+
+struct CullBatch
+{
+    uint32_t instanceBase;
+    uint32_t instanceCount;
+    uint32_t firstRecord;
+    uint32_t recordCount;
+};
+
+// One per batch, mesh node and primitive. Every mesh LOD the visible instances picked becomes an indirect
+// command.
+struct DrawRecord
+{
+    uint32_t firstIndex[MAX_MESH_LODS];
+    uint32_t indexCount[MAX_MESH_LODS];
+    float error[MAX_MESH_LODS];
+    uint32_t lodCount;
+    uint32_t group;
+    // Where the group's commands start.
+    uint32_t firstCommand;
+    // First InstanceData entry of the mesh node's run.
+    uint32_t instanceRun;
+    // Every mesh LOD gets a run of instanceCount visible instance indices from here.
+    uint32_t visibleBase;
+    uint32_t instanceCount;
+    int32_t vertexOffset;
+    uint32_t padding;
+};
+
+struct CullConstants
+{
+    // Normalized, a sphere is outside once it is further than its radius behind any of them.
+    glm::vec4 frustumPlanes[6];
+    glm::vec3 cameraPosition;
+    float pixelsPerUnit;
+    float maxPixelError;
+    uint32_t instanceCount;
+    uint32_t recordCount;
+    uint32_t groupCount;
 };
 
 struct GlobalUniforms
@@ -77,15 +181,72 @@ struct Camera
 struct AllocatedBuffer
 {
     VkBuffer buffer;
-    VkDeviceMemory memory;
+    DeviceAllocation allocation;
     VkDeviceSize size;
     void *data;
 };
 
-struct Primitive
+struct BoundingBox
 {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    inline void Extend(glm::vec3 point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+    inline void Extend(const BoundingBox &box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+    inline bool IsEmpty() const
+    {
+        return min.x > max.x;
+    }
+};
+
+// One level of a primitive's index lists, all levels of a primitive share its vertices.
+struct MeshLod
+{
+    // In indices of the primitive's type, from the start of that type's part of the index buffer.
     uint32_t indexOffset;
     uint32_t indexCount;
+    // Mesh space, how far the surface may have moved from level 0.
+    float error;
+};
+
+struct Primitive
+{
+    // Level 0 is the loaded index list in vertex cache order, every further one simplified from the one before.
+    MeshLod lods[MAX_MESH_LODS];
+    uint32_t lodCount;
+    // Indices are relative to vertexOffset, 16 bit whenever the vertices allow it.
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    VkIndexType indexType;
+    // Mesh space, from the position accessor's min and max.
+    BoundingBox bounds;
+    // Skinned primitives only, range in ModelAsset::jointBounds.
+    uint32_t jointBoundsOffset;
+    uint32_t jointBoundsCount;
+};
+
+// Bind space box around the vertices of one primitive a joint moves.
+struct JointBounds
+{
+    // Index into the skin's joints.
+    uint32_t joint;
+    BoundingBox bounds;
+};
+
+// A primitive as drawn by one mesh node, culled and drawn on its own.
+struct NodePrimitive
+{
+    // Index into ModelAsset::meshNodes.
+    uint32_t meshNode;
+    uint32_t primitive;
 };
 
 struct Mesh
@@ -94,129 +255,288 @@ struct Mesh
     uint32_t primitiveCount;
 };
 
-struct Node
+struct Skin
 {
-    glm::vec3 translation = glm::vec3(0);
-    glm::vec3 scale = glm::vec3(1);
-    glm::quat rotation = glm::quat();
-    glm::mat4 matrix = glm::mat4(1);
-
-    glm::mat4 worldMatrix;
+    std::vector<glm::mat4> inverseBindMatrices;       // readonly
+    std::vector<uint32_t> joints;                     // readonly
+    uint32_t skeleton = UINT32_MAX;                   // readonly, the palette is relative to this node
+    PaletteFormat paletteFormat = PaletteFormat_Mat4; // readonly
+    // vec4s from the start of an instance's palettes, GetPaletteStride(paletteFormat) per joint.
+    uint32_t paletteOffset = 0;
+    // Furthest any vertex gets from a joint it is weighted to, in joint space.
+    float jointRadius = 0.0f;
+};
 
-    uint32_t skinIndex = UINT32_MAX;
-    uint32_t nodeIndex = UINT32_MAX;
-    uint32_t meshIndex = UINT32_MAX;
-    std::vector<Node> children;
+enum SkinningMode
+{
+    SkinningMode_Vertex,
+    SkinningMode_Compute,
+    SkinningMode_Count,
+};
 
-    inline glm::mat4 GetLocalMatrix() const
-    {
-        return glm::translate(glm::mat4(1), translation) * glm::scale(glm::mat4(1), scale) * glm::mat4_cast(rotation) *
-               matrix;
+inline const char *GetSkinningModeName(SkinningMode mode)
+{
+    switch (mode) {
+    case SkinningMode_Vertex:
+        return "vertex";
+    case SkinningMode_Compute:
+        return "compute";
+    default:
+        break;
     }
+    return "unknown";
+}
+
+enum AnimationLod
+{
+    AnimationLod_Full,
+    AnimationLod_Half,
+    AnimationLod_Quarter,
+    AnimationLod_Paused,
+    // Plays palettes baked at load time, the instance's pose isn't touched.
+    AnimationLod_Vat,
+    AnimationLod_Count,
 };
 
-enum InterpolationMethod
+// Sizes are the bounding sphere's diameter as a fraction of the viewport height.
+struct AnimationLodSettings
 {
-    InterpolationMethod_Linear = 0,
+    bool enabled = true;
+    float halfRateSize = 0.3f;
+    float quarterRateSize = 0.1f;
+    // Only instances whose clip has baked palettes.
+    float vatSize = 0.05f;
+    float pausedSize = 0.02f;
+    double budgetMs = 1.0;
 };
 
-template <typename T> struct AnimationSpline
+// Vertex animation texture, every skin's palette sampled at a fixed rate for each clip. Palettes are
+// kept in a storage buffer rather than a texture so the regular skinning shaders can read them. Assets
+// that animate mesh nodes without a skin aren't baked, their palettes wouldn't move those nodes.
+struct VatSettings
 {
-    void GetValueAtTime(float time, T &outValue) const;
+    bool enabled = false;
+    float sampleRate = 30.0f;
+};
 
-    std::vector<T> values;
-    std::vector<float> times;
-    InterpolationMethod method;
+struct VatClip
+{
+    // vec4 index of the first frame in the asset's VAT buffer, frames are paletteSize apart.
+    uint32_t paletteBase = 0;
+    uint32_t frameCount = 0;
+    float sampleRate = 0.0f;
 };
 
-template <> inline void AnimationSpline<glm::quat>::GetValueAtTime(float time, glm::quat &outValue) const
+// Everything loaded from a file. Shared by all of its instances and never changed after loading.
+struct ModelAsset
 {
-    assert(method == InterpolationMethod_Linear && "Unhandled interpolation method");
+    void PackPalettes(PaletteKernel kernel, const glm::mat4 *worldMatrices, glm::vec4 *outPalettes) const;
 
-    for (uint32_t i = 1; i < values.size(); ++i) {
-        auto v0 = values[i - 1];
-        auto v1 = values[i];
-        auto t0 = times[i - 1];
-        auto t1 = times[i];
+    glm::vec3 boundsCenter = glm::vec3(0);
+    float boundsRadius = 0.0f;
+    std::vector<Mesh> meshes;
+    std::vector<Primitive> primitives;
+    std::vector<JointBounds> jointBounds;
+    std::vector<Animation> animations;
+    std::vector<Skin> skins;
+    // Rest pose, instances start from a copy.
+    NodeHierarchy nodes;
+    // Nodes with a mesh, in hierarchy order.
+    std::vector<uint32_t> meshNodes;
+    // The primitives of every mesh node, in the same order.
+    std::vector<NodePrimitive> nodePrimitives;
+    // Vertex positions are xyz + unorm * w, a cube around the bounds so scaling stays uniform.
+    glm::vec4 positionQuantization = glm::vec4(0, 0, 0, 1);
+    // vec4s all skins of one instance take up in the palette ring.
+    uint32_t paletteSize = 0;
+    uint32_t vertexCount = 0;
+    // Compute skinned vertices of one instance, a range per skinned mesh node since nodes sharing a mesh
+    // can still use different skins.
+    uint32_t skinnedVertexCount = 0;
+    // One per mesh node, its range in the instance's skinned vertices minus its mesh's first vertex, so
+    // vertex indices add on as they are. Wraps around for most nodes, only the sum is an index.
+    std::vector<uint32_t> skinnedVertexBases;
+    AllocatedBuffer vertexBuffer;
+    // 16 bit indices first, then 32 bit ones from wideIndexOffset.
+    AllocatedBuffer indexBuffer;
+    VkDeviceSize wideIndexOffset = 0;
+    // One per animation, empty if nothing was baked. Bound in place of the palette ring.
+    std::vector<VatClip> vatClips;
+    // Skinned primitives over every frame of every baked clip, in model space.
+    BoundingBox vatBounds;
+    AllocatedBuffer vatBuffer = {};
+    VkDescriptorSet vatDescriptorSet = nullptr;
+    // Reads vertexBuffer and writes the renderer's skinned vertex buffer, only set for skinned assets.
+    VkDescriptorSet skinningDescriptorSet = nullptr;
+};
 
-        if (t1 > time) {
-            float t = (time - t0) / (t1 - t0);
-            outValue = glm::normalize(glm::slerp(v0, v1, t));
-            break;
-        }
-    }
-}
+// One placed character. Owns its pose and clip state, its palette and skinned vertices are packed
+// into the frame's buffers every frame.
+struct ModelInstance
+{
+    void AdvanceAnimation(float dt);
+    void SampleAnimation(float time, AnimationSampling sampling);
+    void StorePose(AnimationPose &outPose) const;
+    void LoadPose(const AnimationPose &pose);
+    uint32_t UpdateTransforms();
+    // Where the current frame of the clip starts in the asset's VAT buffer, UINT32_MAX unless the
+    // instance is in the VAT LOD.
+    uint32_t GetVatPaletteBase() const;
+
+    const ModelAsset *asset = nullptr;
+    // Never reused, so snapshots can tell instances apart after others were destroyed.
+    uint32_t id = UINT32_MAX;
+    glm::mat4 transform = glm::mat4(1);
+    // The samplers write straight into the hierarchy, so every instance carries a copy of it.
+    NodeHierarchy nodes;
+    float animation_t = 0.0f;
+    const Animation *playingAnimation = nullptr;
+    std::vector<AnimationCursor> animationCursors;
+    AnimationLod animationLod = AnimationLod_Full;
+    float pendingDt = 0.0f;
+    uint32_t framesSinceUpdate = UINT32_MAX;
+    // Bumped whenever the node transforms change so snapshots know when to copy them again.
+    uint32_t poseVersion = 1;
+};
 
-template <typename T> inline void AnimationSpline<T>::GetValueAtTime(float time, T &outValue) const
+// Simplified index lists built at load time. Skinned vertices only collapse onto vertices that follow the
+// same joint the most.
+struct MeshLodSettings
 {
-    assert(method == InterpolationMethod_Linear && "Unhandled interpolation method");
+    bool enabled = true;
+    // Each level aims for this fraction of the previous level's triangles.
+    float reduction = 0.5f;
+    // Relative to the primitive's bounds diagonal, collapses beyond it are never made.
+    float maxError = 0.05f;
+};
 
-    for (uint32_t i = 1; i < values.size(); ++i) {
-        auto v0 = values[i - 1];
-        auto v1 = values[i];
-        auto t0 = times[i - 1];
-        auto t1 = times[i];
+struct ModelLoadOptions
+{
+    AnimationBakeSettings bake;
+    AnimationCompressionSettings compression;
+    VatSettings vat;
+    MeshLodSettings meshLod;
+    PaletteFormat paletteFormat = PaletteFormat_Mat3x4;
+};
 
-        if (t1 > time) {
-            float t = (time - t0) / (t1 - t0);
-            outValue = glm::mix(v0, v1, t);
-            break;
-        }
-    }
-}
+struct RenderStats
+{
+    double animationMs = 0.0;
+    uint32_t animationUpdates = 0;
+    uint32_t animationDemotions = 0;
+    uint32_t animationLods[AnimationLod_Count] = {};
+    uint32_t poseCacheHits = 0;
+    uint32_t poseCacheMisses = 0;
+    uint32_t poseCacheSize = 0;
+    uint32_t nodesUpdated = 0;
+    uint32_t nodeCount = 0;
+    uint32_t jobThreads = 0;
+    double gpuMs = 0.0;
+    uint32_t skinnedVertices = 0;
+    uint32_t paletteBytes = 0;
+    uint32_t instances = 0;
+    uint32_t drawCalls = 0;
+    // CPU path only, the GPU driven path culls without reporting back.
+    uint32_t instancesCulled = 0;
+    uint32_t primitivesDrawn = 0;
+    uint32_t primitivesCulled = 0;
+    // Drawn primitives by mesh LOD.
+    uint32_t meshLods[MAX_MESH_LODS] = {};
+};
 
-struct AnimationSampler
+// Everything an animation update reads besides the instances, copied so it can run on the
+// simulation thread while the settings change on the main one.
+struct AnimationUpdateInput
 {
-    // For the time being assume that animations share a model's lifetime
-    // and therefore this pointer will always be valid.
-    Node *node;
+    Camera camera;
+    glm::mat4 viewProjection = glm::mat4(1);
+    float dt = 0.0f;
+    AnimationSampling sampling = AnimationSampling_Cursor;
+    AnimationLodSettings lod;
+    PoseCacheSettings poseCache;
+    bool parallel = true;
+};
 
-    AnimationSpline<glm::vec3> scale;
-    AnimationSpline<glm::vec3> translation;
-    AnimationSpline<glm::quat> rotation;
+// What drawing needs from an instance.
+struct InstanceSnapshot
+{
+    const ModelAsset *asset = nullptr;
+    uint32_t id = UINT32_MAX;
+    uint32_t poseVersion = 0;
+    uint32_t vatPaletteBase = UINT32_MAX;
+    glm::mat4 transform = glm::mat4(1);
+    std::vector<glm::mat4> worldMatrices;
 };
 
-// Since animations work on specific node they cannot be shared between models,
-// so even thougth they create a cyclical dependency it makes sense.
-struct Animation
+struct FrameSnapshot
 {
-    std::vector<AnimationSampler> samplers;
-    float endTime;
+    std::vector<InstanceSnapshot> instances;
+    RenderStats stats;
 };
 
-struct Skin
+// An instance as it is recorded this frame, taken from the live instances or from a snapshot.
+struct InstanceDraw
 {
-    std::vector<glm::mat4> inverseBindMatrices; // readonly
-    std::vector<Node *> joints;                 // readonly
-    std::vector<glm::mat4> jointMatrices[MAX_FRAMES_IN_FLIGHT];
-    AllocatedBuffer jointMatricesBuffer[MAX_FRAMES_IN_FLIGHT];
-    VkDescriptorSet descriptorSet[MAX_FRAMES_IN_FLIGHT];
+    const ModelAsset *asset;
+    glm::mat4 transform;
+    const glm::mat4 *worldMatrices;
+    uint32_t vatPaletteBase;
+    uint32_t paletteBase;
+    uint32_t skinnedVertexBase;
+    uint32_t batch;
+    // Position within the batch.
+    uint32_t batchIndex;
+    // Where the draw's node primitive visibility starts.
+    uint32_t visibilityBase;
+    // Anything of it is in the frustum.
+    bool visible;
 };
 
-struct Model
+// All instances of one asset, drawn with one instanced call per primitive. VAT instances get a batch
+// of their own since they read a different palette buffer.
+struct DrawBatch
 {
-    void UpdateAnimations(float dt);
-    void UpdateTransforms();
-    void UpdateTransforms(glm::mat4 parentMatrix, Node &node);
+    const ModelAsset *asset;
+    bool vat;
+    uint32_t instanceCount;
+    // First InstanceData entry of the batch in the frame's instance ring.
+    uint32_t instanceBase;
+    // CPU culling, every node primitive gets a run of instanceCount visible instance indices and a count.
+    // Visible instances of a node primitive are sorted by mesh LOD.
+    uint32_t visibleBase;
+    uint32_t firstNodePrimitive;
+};
 
-    // Static
-    std::vector<Mesh> meshes;
-    std::vector<Primitive> primitives;
-    std::vector<Animation> animations;
-    std::vector<Skin> skins;
+// The records of one batch that share a pipeline and index type, submitted with a single indirect draw.
+struct DrawGroup
+{
+    uint32_t batch;
+    VkPipeline pipeline;
+    // Draws the compute skinned vertices, there is no vertex buffer to bind.
+    bool preSkinned;
+    VkIndexType indexType;
+    uint32_t firstCommand;
+    uint32_t commandCount;
+};
 
-    // TODO:
-    //
-    // If I have many instances of a model some of this information will
-    // remain constant (vertex data, etc) some of it however changes at runtime (ie node positions)
-    // so there is probobly two seperate things here.
+// Static buffers on their way to device local memory, copied on the transfer queue. The first frame
+// recorded after submission waits on the semaphore and acquires the buffers before anything reads them.
+struct PendingUpload
+{
+    VkCommandBuffer commandBuffer = nullptr;
+    VkFence fence = nullptr;
+    VkSemaphore semaphore = nullptr;
+    std::vector<AllocatedBuffer> stagingBuffers;
+    std::vector<VkBufferMemoryBarrier2> acquireBarriers;
+    // Frame that acquired the buffers, UINT64_MAX until one has.
+    uint64_t acquireFrame = UINT64_MAX;
+};
 
-    // Dynamic
-    Node rootNode;
-    float animation_t = 0.0f;
-    Animation *playingAnimation = nullptr;
-    AllocatedBuffer vertexBuffer;
-    AllocatedBuffer indexBuffer;
+struct ModelUpdateStats
+{
+    uint32_t poseCacheHits = 0;
+    uint32_t poseCacheMisses = 0;
+    uint32_t nodesUpdated = 0;
 };
 
 class Renderer
@@ -225,17 +545,141 @@ class Renderer
     bool Init(GLFWwindow *window);
     bool Render(const Camera &camera, GLFWwindow *window, double dt);
     void Shutdown();
-    bool LoadModel(const char *path);
+    bool LoadModel(const char *path, const ModelLoadOptions &loadOptions, const ModelAsset *&outAsset);
+    // Instances can be created and destroyed at any time, pipelined or not. Plays `animation` of the
+    // asset from the start, UINT32_MAX leaves it in the rest pose.
+    uint32_t CreateModelInstance(const ModelAsset *asset, const glm::mat4 &transform, uint32_t animation = 0);
+    void DestroyModelInstance(uint32_t id);
+    void SetModelInstanceTransform(uint32_t id, const glm::mat4 &transform);
+
+    inline uint32_t GetModelInstanceCount() const
+    {
+        return (uint32_t)m_instances.size();
+    }
+
+    inline void SetAnimationSampling(AnimationSampling sampling)
+    {
+        m_animationSampling = sampling;
+    }
+    inline AnimationSampling GetAnimationSampling() const
+    {
+        return m_animationSampling;
+    }
+    inline AnimationLodSettings &GetAnimationLodSettings()
+    {
+        return m_animationLodSettings;
+    }
+    inline PoseCacheSettings &GetPoseCacheSettings()
+    {
+        return m_poseCacheSettings;
+    }
+    inline void SetParallelUpdate(bool parallel)
+    {
+        m_parallelUpdate = parallel;
+    }
+    inline bool GetParallelUpdate() const
+    {
+        return m_parallelUpdate;
+    }
+    // Runs animation on its own thread one frame ahead of recording.
+    inline void SetPipelined(bool pipelined)
+    {
+        m_pipelined = pipelined;
+    }
+    inline bool GetPipelined() const
+    {
+        return m_pipelined;
+    }
+    inline void SetSkinningMode(SkinningMode mode)
+    {
+        m_skinningMode = mode;
+    }
+    inline SkinningMode GetSkinningMode() const
+    {
+        return m_skinningMode;
+    }
+    // Draws the scene this many times per frame, standing in for extra depth or shadow passes.
+    inline void SetPassCount(uint32_t passCount)
+    {
+        m_passCount = std::max(passCount, 1u);
+    }
+    inline uint32_t GetPassCount() const
+    {
+        return m_passCount;
+    }
+    inline void SetPaletteKernel(PaletteKernel kernel)
+    {
+        m_paletteKernel = std::min(kernel, GetSupportedPaletteKernel());
+    }
+    inline PaletteKernel GetPaletteKernel() const
+    {
+        return m_paletteKernel;
+    }
+    // Culls and builds the draws on the GPU, needs indirect draws with a first instance.
+    inline void SetGpuDriven(bool gpuDriven)
+    {
+        m_gpuDriven = gpuDriven && m_drawIndirectFirstInstance;
+    }
+    inline bool GetGpuDriven() const
+    {
+        return m_gpuDriven;
+    }
+    // Picks the coarsest mesh LOD whose error stays under this many pixels, zero always draws level 0.
+    inline void SetMeshLodPixelError(float pixelError)
+    {
+        m_meshLodPixelError = std::max(pixelError, 0.0f);
+    }
+    inline float GetMeshLodPixelError() const
+    {
+        return m_meshLodPixelError;
+    }
+    inline const DeviceAllocatorStats &GetMemoryStats() const
+    {
+        return m_allocator.GetStats();
+    }
+    inline const RenderStats &GetStats() const
+    {
+        return m_stats;
+    }
 
   private:
-    void RenderNode(VkCommandBuffer commandBuffer, uint32_t frameIndex, Model &model, const Node &node);
+    void UpdateAnimations(const AnimationUpdateInput &input, RenderStats &outStats);
+    void UpdateInstance(ModelInstance &instance, const AnimationUpdateInput &input, ModelUpdateStats &outStats);
+    void BuildDraws(const FrameSnapshot *snapshot);
+    bool UpdateDraws(uint32_t frameIndex, const Camera &camera, const glm::mat4 &viewProjection);
+    uint32_t SkinInstance(VkCommandBuffer commandBuffer, const InstanceDraw &draw);
+    uint32_t RenderBatch(VkCommandBuffer commandBuffer, const DrawBatch &batch);
+    VkPipeline ChoosePipeline(const DrawBatch &batch, uint32_t node) const;
+    uint32_t BuildDrawRecords();
+    void CullInstances(VkCommandBuffer commandBuffer, uint32_t frameIndex, const Camera &camera,
+                       const glm::mat4 &viewProjection);
+    uint32_t RenderGroup(VkCommandBuffer commandBuffer, uint32_t frameIndex, uint32_t groupIndex);
+
+    void StartSimulation(const AnimationUpdateInput &input);
+    void StopSimulation();
+    void SimulationMain();
+    void WriteSnapshot(FrameSnapshot &outSnapshot);
 
     bool ReadFileBytes(const char *path, std::vector<uint8_t> &outBytes);
     bool CompileShader(const void *bytes, uint32_t size, VkShaderModule &outShader);
 
-    bool AllocateDeviceMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags propertyFlags,
-                              VkDeviceMemory &outMemory);
-    bool CreateBuffer(VkBufferUsageFlags usage, VkDeviceSize size, AllocatedBuffer &outBuffer);
+    bool CreateBuffer(VkBufferUsageFlags usage, VkDeviceSize size, AllocatedBuffer &outBuffer,
+                      VkMemoryPropertyFlags propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    void DestroyBuffer(AllocatedBuffer &buffer);
+    // Creates a device local buffer and records copying `data` into it through a staging buffer. Goes
+    // out with the next SubmitUploads, the buffer can be drawn from by any frame recorded after that.
+    bool UploadBuffer(VkBufferUsageFlags usage, const void *data, VkDeviceSize size, AllocatedBuffer &outBuffer);
+    bool SubmitUploads();
+    void AcquireUploads(VkCommandBuffer commandBuffer);
+    void RetireUploads();
+    // Grows a per frame buffer and points `binding` of the set at it.
+    bool ReserveRing(AllocatedBuffer &ring, VkDescriptorSet descriptorSet, uint32_t binding, VkDeviceSize size,
+                     VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VkMemoryPropertyFlags propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    bool ReserveSkinnedVertices(uint32_t vertexCount);
+    void WriteSkinningDescriptors(const ModelAsset &asset);
     bool CreateImage();
 
     bool CreateInstance();
@@ -251,6 +695,8 @@ class Renderer
     bool CreateDescriptorSets();
     bool CreatePipelineLayouts();
     bool CreateGraphicsPipelines();
+    bool CreateComputePipelines();
+    bool CreateQueryPool();
     bool InitVulkan(GLFWwindow *window);
 
     bool HandleResize(GLFWwindow *window);
@@ -260,10 +706,17 @@ class Renderer
     VkPhysicalDevice m_physicalDevice = nullptr;
     uint32_t m_graphicsFamilyIndex = UINT32_MAX;
     uint32_t m_presentFamilyIndex = UINT32_MAX;
-    VkPhysicalDeviceMemoryProperties m_memoryProperties;
     VkDevice m_device = nullptr;
+    // Every buffer and image allocation goes through it.
+    DeviceAllocator m_allocator;
     VkQueue m_graphicsQueue = nullptr;
     VkQueue m_presentQueue = nullptr;
+    // A transfer only family when the device has one, the graphics family otherwise.
+    uint32_t m_transferFamilyIndex = UINT32_MAX;
+    VkQueue m_transferQueue = nullptr;
+    bool m_drawIndirectFirstInstance = false;
+    bool m_multiDrawIndirect = false;
+    bool m_drawIndirectCount = false;
 
     uint32_t m_swapchainImageCount = 0;
     VkSwapchainKHR m_swapchain = nullptr;
@@ -275,7 +728,7 @@ class Renderer
     VkImage m_depthBufferImage;
     VkImageView m_depthBufferImageView;
     VkFormat m_depthBufferFormat;
-    VkDeviceMemory m_depthBufferMemory;
+    DeviceAllocation m_depthBufferAllocation;
 
     VkCommandPool m_commandPool = nullptr;
     uint32_t m_nextFrameIndex = 0;
@@ -283,16 +736,98 @@ class Renderer
     VkCommandBuffer m_commandBuffers[MAX_FRAMES_IN_FLIGHT] = {};
     VkSemaphore m_imageReady[MAX_FRAMES_IN_FLIGHT] = {};
     VkSemaphore m_renderFinished[MAX_FRAMES_IN_FLIGHT] = {};
+    uint64_t m_frameCount = 0;
+
+    VkCommandPool m_transferCommandPool = nullptr;
+    // Recorded into until the next SubmitUploads.
+    PendingUpload m_openUpload;
+    std::vector<PendingUpload> m_pendingUploads;
+    std::vector<VkSemaphore> m_waitSemaphores;
+    std::vector<VkPipelineStageFlags> m_waitStages;
 
     VkDescriptorPool m_descriptorPool;
-    VkDescriptorSetLayout m_jointsDescriptorsLayout;
+    VkDescriptorSetLayout m_paletteDescriptorsLayout;
     VkDescriptorSetLayout m_globalDescriptorsLayout;
+    VkDescriptorSetLayout m_skinningDescriptorsLayout;
+    VkDescriptorSetLayout m_cullDescriptorsLayout;
     AllocatedBuffer m_globalUniformBuffers[MAX_FRAMES_IN_FLIGHT] = {};
     VkDescriptorSet m_globalDescriptors[MAX_FRAMES_IN_FLIGHT] = {};
+    // Every skin's palette for the frame, packed in place each frame and grown when it runs out.
+    AllocatedBuffer m_paletteRings[MAX_FRAMES_IN_FLIGHT] = {};
+    VkDescriptorSet m_paletteDescriptors[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_instanceRings[MAX_FRAMES_IN_FLIGHT] = {};
+    // Instance data indices of everything drawn, every draw reads its instances through them. Filled by
+    // CPU culling through a mapping or by the culling pass of the GPU driven path in device local memory.
+    AllocatedBuffer m_visibleInstanceRings[MAX_FRAMES_IN_FLIGHT] = {};
+    bool m_visibleInstancesDeviceLocal[MAX_FRAMES_IN_FLIGHT] = {};
+    // GPU driven path, counts and commands never leave the GPU.
+    VkDescriptorSet m_cullDescriptors[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_cullInstanceRings[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_cullBatchRings[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_drawRecordRings[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_drawCountRings[MAX_FRAMES_IN_FLIGHT] = {};
+    AllocatedBuffer m_drawCommandRings[MAX_FRAMES_IN_FLIGHT] = {};
 
     VkPipelineLayout m_pipelineLayout = nullptr;
-    VkPipeline m_pipeline = nullptr;
-
-    // TODO: Scene.
-    std::vector<Model> m_models;
+    // Skinned pipelines are specialized per palette format.
+    VkPipeline m_pipelines[PaletteFormat_Count] = {};
+    VkPipeline m_staticPipeline = nullptr;
+    VkPipelineLayout m_skinningPipelineLayout = nullptr;
+    VkPipeline m_skinningPipelines[PaletteFormat_Count] = {};
+    VkPipelineLayout m_cullPipelineLayout = nullptr;
+    VkPipeline m_cullPipeline = nullptr;
+    VkPipeline m_drawCommandPipeline = nullptr;
+    // Compute skinning output of every instance, shared by all frames in flight.
+    AllocatedBuffer m_skinnedVertexBuffer = {};
+
+    // Two timestamps per frame in flight, read back once the frame's fence has signaled.
+    VkQueryPool m_queryPool = nullptr;
+    float m_timestampPeriod = 0.0f;
+    bool m_timestampsWritten[MAX_FRAMES_IN_FLIGHT] = {};
+
+    std::vector<std::unique_ptr<ModelAsset>> m_assets;
+    // Packed, destroying swaps the last instance into the hole. Ids map to the current index.
+    std::vector<ModelInstance> m_instances;
+    std::unordered_map<uint32_t, uint32_t> m_instanceIndices;
+    uint32_t m_nextInstanceId = 0;
+    // Held by whichever thread runs the animation update while it touches the instances.
+    std::mutex m_instancesMutex;
+    std::vector<InstanceDraw> m_draws;
+    std::vector<DrawBatch> m_batches;
+    // Regular and VAT batches.
+    std::unordered_map<const ModelAsset *, uint32_t> m_batchIndices[2];
+    // One entry per draw and node primitive, zero if culled or else one past its mesh LOD. Counts and
+    // cursors are per batch, node primitive and mesh LOD.
+    std::vector<uint8_t> m_primitiveVisibility;
+    std::vector<uint32_t> m_primitiveCounts;
+    std::vector<uint32_t> m_primitiveCursors;
+    std::vector<DrawRecord> m_drawRecords;
+    std::vector<DrawGroup> m_drawGroups;
+    uint32_t m_drawCommandCount = 0;
+
+    AnimationSampling m_animationSampling = AnimationSampling_Cursor;
+    AnimationLodSettings m_animationLodSettings;
+    std::vector<std::pair<float, uint32_t>> m_animationQueue;
+    double m_animationUpdateMs = 0.0;
+    std::vector<ModelUpdateStats> m_updateStats;
+    PoseCacheSettings m_poseCacheSettings;
+    PoseCache m_poseCache;
+    JobSystem m_jobs;
+    bool m_parallelUpdate = true;
+    PaletteKernel m_paletteKernel = GetSupportedPaletteKernel();
+
+    bool m_pipelined = false;
+    std::thread m_simulationThread;
+    std::atomic<bool> m_simulationRunning = false;
+    // Bumped for every frame the render thread hands over, the simulation thread waits on it.
+    std::atomic<uint64_t> m_simulationRequest = 0;
+    std::mutex m_simulationInputMutex;
+    AnimationUpdateInput m_simulationInput;
+    TripleBuffer<FrameSnapshot> m_snapshots;
+    bool m_hasSnapshot = false;
+    SkinningMode m_skinningMode = SkinningMode_Vertex;
+    bool m_gpuDriven = false;
+    float m_meshLodPixelError = 1.0f;
+    uint32_t m_passCount = 1;
+    RenderStats m_stats;
 };
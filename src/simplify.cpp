@@ -0,0 +1,206 @@
+#include "simplify.h"
+
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+// Symmetric 4x4 matrix summing the squared distance to a set of planes. The planes aren't weighted, so
+// the square root of the sum bounds the distance to every single one of them.
+struct Quadric
+{
+    double a00, a01, a02, a03;
+    double a11, a12, a13;
+    double a22, a23;
+    double a33;
+};
+
+struct Collapse
+{
+    uint32_t from;
+    uint32_t to;
+    float cost;
+};
+
+static Quadric MakeQuadric(glm::vec3 normal, float distance)
+{
+    const double a = normal.x, b = normal.y, c = normal.z, d = distance;
+    return {a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d};
+}
+
+static void AddQuadric(Quadric &q, const Quadric &other)
+{
+    q.a00 += other.a00;
+    q.a01 += other.a01;
+    q.a02 += other.a02;
+    q.a03 += other.a03;
+    q.a11 += other.a11;
+    q.a12 += other.a12;
+    q.a13 += other.a13;
+    q.a22 += other.a22;
+    q.a23 += other.a23;
+    q.a33 += other.a33;
+}
+
+// Summed squared distance of `p` to the planes of both quadrics.
+static float GetCollapseCost(const Quadric &q0, const Quadric &q1, glm::vec3 p)
+{
+    Quadric q = q0;
+    AddQuadric(q, q1);
+    const double x = p.x, y = p.y, z = p.z;
+    const double error = x * x * q.a00 + y * y * q.a11 + z * z * q.a22 + q.a33 +
+                         2.0 * (x * y * q.a01 + x * z * q.a02 + y * z * q.a12 + x * q.a03 + y * q.a13 + z * q.a23);
+    return (float)std::max(error, 0.0);
+}
+
+static uint64_t GetEdgeKey(uint32_t a, uint32_t b)
+{
+    return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+// Moving `from` onto `to` must not turn any of the triangles around it over.
+static bool FlipsTriangles(const glm::vec3 *positions, const std::vector<uint32_t> &indices,
+                           const uint32_t *triangles, uint32_t triangleCount, uint32_t from, uint32_t to)
+{
+    for (uint32_t i = 0; i < triangleCount; ++i) {
+        const uint32_t *triangle = &indices[triangles[i] * 3];
+        if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+            continue;
+        }
+
+        glm::vec3 corners[3] = {positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]};
+        const glm::vec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+        for (uint32_t k = 0; k < 3; ++k) {
+            if (triangle[k] == from) {
+                corners[k] = positions[to];
+            }
+        }
+        const glm::vec3 after = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+        if (glm::dot(before, after) <= 0.0f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every pass collapses the cheapest edges whose neighbourhoods don't overlap, then compacts the
+// triangles, until the target or the error limit is reached.
+float SimplifyMesh(const glm::vec3 *positions, const uint32_t *groups, uint32_t vertexCount,
+                   std::vector<uint32_t> &indices, uint32_t targetIndexCount, float maxError)
+{
+    std::vector<Quadric> quadrics(vertexCount, Quadric{});
+    std::unordered_map<uint64_t, uint32_t> edgeUses;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const glm::vec3 p0 = positions[indices[i + 0]];
+        const glm::vec3 normal = glm::cross(positions[indices[i + 1]] - p0, positions[indices[i + 2]] - p0);
+        const float length = glm::length(normal);
+        if (length > 0.0f) {
+            const glm::vec3 n = normal / length;
+            const Quadric q = MakeQuadric(n, -glm::dot(n, p0));
+            for (uint32_t k = 0; k < 3; ++k) {
+                AddQuadric(quadrics[indices[i + k]], q);
+            }
+        }
+        for (uint32_t k = 0; k < 3; ++k) {
+            edgeUses[GetEdgeKey(indices[i + k], indices[i + (k + 1) % 3])]++;
+        }
+    }
+
+    std::vector<uint8_t> locked(vertexCount, 0);
+    for (const auto &[key, uses] : edgeUses) {
+        if (uses == 1) {
+            locked[key >> 32] = 1;
+            locked[key & 0xffffffff] = 1;
+        }
+    }
+
+    float resultError = 0.0f;
+    const float maxCost = maxError * maxError;
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> triangleOffsets;
+    std::vector<uint32_t> vertexTriangles;
+    std::vector<uint8_t> touched;
+    std::vector<uint32_t> remap(vertexCount);
+    while (indices.size() > targetIndexCount) {
+        const uint32_t triangleCount = (uint32_t)indices.size() / 3;
+
+        collapses.clear();
+        for (uint32_t i = 0; i < indices.size(); ++i) {
+            const uint32_t from = indices[i];
+            const uint32_t to = indices[i - i % 3 + (i + 1) % 3];
+            if (!locked[from] && groups[from] == groups[to]) {
+                collapses.push_back({from, to, GetCollapseCost(quadrics[from], quadrics[to], positions[to])});
+            }
+            if (!locked[to] && groups[from] == groups[to]) {
+                collapses.push_back({to, from, GetCollapseCost(quadrics[from], quadrics[to], positions[from])});
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(),
+                  [](const Collapse &a, const Collapse &b) { return a.cost < b.cost; });
+
+        triangleOffsets.assign(vertexCount + 1, 0);
+        for (uint32_t index : indices) {
+            triangleOffsets[index + 1]++;
+        }
+        for (uint32_t v = 0; v < vertexCount; ++v) {
+            triangleOffsets[v + 1] += triangleOffsets[v];
+        }
+        vertexTriangles.resize(indices.size());
+        {
+            std::vector<uint32_t> cursors(triangleOffsets.begin(), triangleOffsets.end() - 1);
+            for (uint32_t i = 0; i < indices.size(); ++i) {
+                vertexTriangles[cursors[indices[i]]++] = i / 3;
+            }
+        }
+
+        for (uint32_t v = 0; v < vertexCount; ++v) {
+            remap[v] = v;
+        }
+        touched.assign(vertexCount, 0);
+        uint32_t collapseCount = 0;
+        uint32_t remainingTriangles = triangleCount;
+        for (const auto &collapse : collapses) {
+            if (collapse.cost > maxCost || remainingTriangles * 3 <= targetIndexCount) {
+                break;
+            }
+            if (touched[collapse.from] || touched[collapse.to]) {
+                continue;
+            }
+
+            const uint32_t *triangles = &vertexTriangles[triangleOffsets[collapse.from]];
+            const uint32_t adjacentCount = triangleOffsets[collapse.from + 1] - triangleOffsets[collapse.from];
+            if (FlipsTriangles(positions, indices, triangles, adjacentCount, collapse.from, collapse.to)) {
+                continue;
+            }
+
+            // Everything around the moved vertex is off limits for the rest of the pass.
+            for (uint32_t i = 0; i < adjacentCount; ++i) {
+                const uint32_t *triangle = &indices[triangles[i] * 3];
+                touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to) {
+                    remainingTriangles--;
+                }
+            }
+            remap[collapse.from] = collapse.to;
+            AddQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+            resultError = std::max(resultError, sqrtf(collapse.cost));
+            collapseCount++;
+        }
+        if (collapseCount == 0) {
+            break;
+        }
+
+        size_t writeIndex = 0;
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            const uint32_t a = remap[indices[i + 0]];
+            const uint32_t b = remap[indices[i + 1]];
+            const uint32_t c = remap[indices[i + 2]];
+            if (a != b && b != c && c != a) {
+                indices[writeIndex++] = a;
+                indices[writeIndex++] = b;
+                indices[writeIndex++] = c;
+            }
+        }
+        indices.resize(writeIndex);
+    }
+    return resultError;
+}
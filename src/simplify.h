@@ -0,0 +1,14 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include <vector>
+
+// Collapses edges of the triangle list `indices` by quadric error until at most targetIndexCount
+// indices are left or the next collapse would move the surface further than maxError. Collapses
+// only move a vertex onto another one, so the result indexes the same vertices. A vertex only
+// collapses onto one of the same group and vertices on a border, which includes attribute seams,
+// never move. Returns a bound on how far a collapsed vertex ended up from any plane of the triangles
+// it was part of, the root of its summed squared distances.
+float SimplifyMesh(const glm::vec3 *positions, const uint32_t *groups, uint32_t vertexCount,
+                   std::vector<uint32_t> &indices, uint32_t targetIndexCount, float maxError);